@@ -0,0 +1,67 @@
+#ifndef UAL_EXTENSION_H
+#define UAL_EXTENSION_H
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Native extensions for UALRunner.
+ * An extension is a shared library which exports UAL_ExtensionInit. UALRunner loads it (UALRunner --ext <library> <program> ...),
+ * and calls UAL_ExtensionInit, which registers the functions UAL code can call as native methods (by method name).
+ * Managed objects are passed by pointer, and can be read and written in place for as long as the call lasts;
+ * keep one around after the call returns only while it is registered as a root (see AddRoot).
+ * */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//Bumped whenever this header changes in a way which breaks existing extensions
+#define UAL_EXTENSION_ABI_VERSION 1
+
+//The header of a managed array; the elements follow it
+typedef struct {
+  size_t count; //The number of elements in the array
+  size_t stride; //The size of each element in the array (in bytes), or zero if array of objects
+} GC_Array_Header;
+
+//The header of a managed string; the characters follow it (NULL-terminated)
+typedef struct {
+  uint32_t length;
+} GC_String_Header;
+
+//The C type of a parameter (or of the return value) of a native function
+typedef enum {
+  UAL_TYPE_VOID,
+  UAL_TYPE_INT, //int (System.Int32)
+  UAL_TYPE_DOUBLE, //double (System.Double)
+  UAL_TYPE_POINTER, //Any object, as a pointer
+  UAL_TYPE_STRING, //GC_String_Header* (System.String)
+  UAL_TYPE_ARRAY //GC_Array_Header*
+} UAL_Type;
+
+//What the runtime offers an extension
+typedef struct {
+  uint32_t abiVersion; //UAL_EXTENSION_ABI_VERSION of the runtime
+  //Registers a native function under a method name. Returns zero if the signature is not supported.
+  int (*Register)(const char* name, void* func, UAL_Type returnType, const UAL_Type* args, size_t argCount);
+  //Keeps the object a variable points to alive (and the variable up to date) until RemoveRoot
+  void (*AddRoot)(void** variable);
+  void (*RemoveRoot)(void** variable);
+} UAL_Runtime;
+
+//Exported by every extension. Returns zero on success.
+typedef int (*UAL_ExtensionInitFunc)(const UAL_Runtime* runtime);
+
+//The elements of an array of a primitive type (NULL for arrays of objects, whose elements are not stored in the array)
+static inline void* UAL_ArrayData(GC_Array_Header* array) {
+  return array->stride ? (void*)(array+1) : 0;
+}
+//The characters of a string
+static inline const char* UAL_StringData(GC_String_Header* str) {
+  return (const char*)(str+1);
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif
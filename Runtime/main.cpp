@@ -1,30 +1,487 @@
 #define ASMJIT_TRACE
 #include "Runtime.h"
+#include "UALExtension.h"
 #include <stdio.h>
 #include <map>
+#include <unordered_map>
 #include <string.h>
+#include <math.h>
 #include <memory>
 #include <stack>
 #include <vector>
+#include <algorithm>
+#include <functional>
+#include <exception>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <complex>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <errno.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <utime.h>
+#include <time.h>
 #include <fcntl.h>
 #include <dlfcn.h>
+#include <cpuid.h>
+#include <elf.h>
 //#define GC_FAKE
 #include "../GC/GC.h"
 #include <set>
 #include "../asmjit/src/asmjit/asmjit.h"
 #define DEBUGMODE
+//The largest method body (in parse tree nodes) which may be inlined into its callers
+#define INLINE_NODE_LIMIT 32
+//Callees with more bytecode than this (in bytes) are not parsed ahead of time just so that they can be inlined
+#define INLINE_BYTECODE_LIMIT 256
+//Run methods on the bytecode interpreter until they turn out to be hot (comment out to compile every method up front)
+#define INTERPRETER
+//Calls to a method on the interpreter before it is compiled to native code
+#define TIER_UP_INVOCATIONS 1000
+//Backward branches taken by a method on the interpreter before it is compiled to native code
+#define TIER_UP_BACKEDGES 10000
+//The deepest evaluation stack the interpreter supports
+#define INTERPRETER_STACK_SIZE 256
+//Threads which compile methods in parallel (0 for one per CPU core)
+#define JIT_THREADS 0
+//Compile the whole module, in parallel, as soon as it is loaded (rather than as methods are called)
+//#define PRECOMPILE
+//Directory which keeps compiled methods between runs, in the cache directory of the user ($XDG_CACHE_HOME, or ~/.cache). Define to enable the code cache.
+//#define CODE_CACHE_DIR "ualrunner"
+//Bump whenever the code the JIT emits (or the way it calls into the runtime) changes; cached and ahead of time compiled code of another version is not used
+#define CODEGEN_VERSION 1
+//Bump whenever the layout of code cache files changes
+#define CODE_CACHE_VERSION 2
+#define CODE_CACHE_MAGIC 0x434c4155 //UALC
+//Code cache entries which have not been used for this long (in seconds) are deleted
+#define CODE_CACHE_MAX_AGE (30*24*60*60)
+#define AOT_MAGIC 0x4e4c4155 //UALN
+//Modules in the indexed format (see UALModule::SaveIndexed) start with this; bump the version whenever its layout changes
+#define UAL_INDEX_MAGIC 0x494c4155 //UALI
+#define UAL_INDEX_VERSION 1
+//Bytes of console output each thread collects before writing them out
+#define CONSOLE_BUFFER_SIZE 65536
+//Size of each block a method allocates its parse tree from (larger allocations get a block of their own)
+#define ARENA_BLOCK_SIZE 16384
+//Count calls and branch outcomes in JIT code, and dump the counts at exit (see Profile_Dump)
+//#define PROFILE
+//Build in UALRunner --selftest, which checks that the interpreter and the JIT agree (see SelfTest)
+//#define SELFTEST
 
 void* gc;
 
 //BEGIN PLATFORM CODE
 
 asmjit::JitRuntime* JITruntime;
-asmjit::X86Compiler* JITCompiler;
-asmjit::X86Assembler* JITAssembler;
+//Every thread which compiles code has a compiler of its own (see JIT_EnsureContext)
+thread_local asmjit::X86Compiler* JITCompiler;
+thread_local asmjit::X86Assembler* JITAssembler;
+static std::mutex JITruntimeLock; //Guards allocation of executable memory from JITruntime
+
+//Internal -- Creates the compiler of the calling thread on first use
+static void JIT_EnsureContext() {
+  if(JITAssembler == 0) {
+    JITAssembler = new asmjit::X86Assembler(JITruntime);
+    JITCompiler = new asmjit::X86Compiler(JITAssembler);
+  }
+}
+
+/**
+ * @summary A pool of threads which run compile jobs. Each thread compiles with a JITCompiler of its own.
+ * */
+class JITWorkerPool {
+public:
+  std::mutex lock;
+  std::condition_variable wake; //Signalled when jobs are queued
+  std::condition_variable idle; //Signalled when the last running job has finished
+  std::vector<std::function<void()> > jobs;
+  size_t running; //Jobs which have been queued but have not finished yet
+  const char* error; //The first error thrown by a job
+  JITWorkerPool(size_t count) {
+    running = 0;
+    error = 0;
+    for(size_t i = 0;i<count;i++) {
+      std::thread(&JITWorkerPool::Work,this).detach();
+    }
+  }
+  void Work() {
+    JIT_EnsureContext();
+    std::unique_lock<std::mutex> guard(lock);
+    while(true) {
+      while(jobs.empty()) {
+	wake.wait(guard);
+      }
+      std::function<void()> job = jobs.back();
+      jobs.pop_back();
+      guard.unlock();
+      try {
+	job();
+      }catch(const char* er) {
+	std::lock_guard<std::mutex> errorGuard(lock);
+	if(error == 0) {
+	  error = er;
+	}
+      }
+      guard.lock();
+      running--;
+      if(running == 0) {
+	idle.notify_all();
+      }
+    }
+  }
+  //Runs jobs on the pool, and waits for all of them to finish
+  void Run(const std::vector<std::function<void()> >& batch) {
+    std::unique_lock<std::mutex> guard(lock);
+    jobs.insert(jobs.end(),batch.begin(),batch.end());
+    running+=batch.size();
+    wake.notify_all();
+    while(running) {
+      idle.wait(guard);
+    }
+    if(error) {
+      const char* er = error;
+      error = 0;
+      throw er;
+    }
+  }
+};
+static JITWorkerPool* JITPool;
+
+//The number of threads to compile on
+static size_t JIT_ThreadCount() {
+  size_t count = JIT_THREADS ? JIT_THREADS : std::thread::hardware_concurrency();
+  return count ? count : 1;
+}
+//Runs compile jobs; on the worker pool if there is more than one
+static void JIT_RunJobs(const std::vector<std::function<void()> >& jobs) {
+  if(jobs.size() == 1) {
+    jobs[0]();
+    return;
+  }
+  if(JITPool == 0) {
+    JITPool = new JITWorkerPool(JIT_ThreadCount());
+  }
+  JITPool->Run(jobs);
+}
+
+//Internal -- Adds bytes to a 64-bit FNV-1a hash
+static uint64_t Hash_Add(uint64_t hash, const void* data, size_t len) {
+  const unsigned char* bytes = (const unsigned char*)data;
+  for(size_t i = 0;i<len;i++) {
+    hash^=bytes[i];
+    hash*=1099511628211ULL;
+  }
+  return hash;
+}
+//Internal -- Hashes everything besides the UAL which decides what code comes out: the version of the code generator, the CPU features it emits code for, and whether it counts calls and branches
+static uint64_t Cache_RuntimeHash() {
+  static uint64_t hash = 0;
+  if(hash == 0) {
+    hash = 14695981039346656037ULL;
+    uint32_t version = CODEGEN_VERSION;
+    hash = Hash_Add(hash,&version,sizeof(version));
+    //The JIT uses SSE2 for System.Double, and nothing newer
+    unsigned int regs[4] = {0,0,0,0};
+    __get_cpuid(1,regs,regs+1,regs+2,regs+3);
+    uint32_t features = regs[3] & bit_SSE2;
+    hash = Hash_Add(hash,&features,sizeof(features));
+    //Code without counters would be left out of Profile_Dump, and code with them needs profile imports
+#ifdef PROFILE
+    uint32_t profiled = 1;
+#else
+    uint32_t profiled = 0;
+#endif
+    hash = Hash_Add(hash,&profiled,sizeof(profiled));
+  }
+  return hash;
+}
+//Internal -- Allocates executable memory for code loaded from the code cache
+static void* Cache_AllocCode(size_t size) {
+  static unsigned char* arena = 0;
+  static size_t arenaLeft = 0;
+  size = (size+15) & ~(size_t)15;
+  if(size > arenaLeft) {
+    size_t len = size > 65536 ? size : 65536;
+    void* mem = mmap(0,len,PROT_READ | PROT_WRITE | PROT_EXEC,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+    if(mem == MAP_FAILED) {
+      throw "Out of executable memory.";
+    }
+    arena = (unsigned char*)mem;
+    arenaLeft = len;
+  }
+  void* retval = arena;
+  arena+=size;
+  arenaLeft-=size;
+  return retval;
+}
+#ifdef CODE_CACHE_DIR
+//The header of a code cache file. The payload which follows is only trusted once every field checks out.
+struct CacheHeader {
+  uint32_t magic; //CODE_CACHE_MAGIC
+  uint32_t version; //CODE_CACHE_VERSION
+  uint64_t runtime; //Cache_RuntimeHash of the runtime which wrote the file
+  uint64_t key; //The cache key of the method (see UALMethod::HashCode)
+  uint64_t length; //Bytes of payload
+  uint64_t checksum; //Hash_Add of the payload
+};
+//Internal -- Whether or not a directory belongs to the current user, and nobody else can write to it
+static bool Cache_IsPrivate(const char* path) {
+  struct stat info;
+  return lstat(path,&info) == 0 && S_ISDIR(info.st_mode) && info.st_uid == getuid() && (info.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+/**
+ * @summary Deletes the entries of the code cache which cannot be used any more: those written by another build of the runtime
+ * (whose keys never match again), those unused for CODE_CACHE_MAX_AGE, and temporary files left behind by processes which died while writing.
+ * Runs at most once a day, since it reads the header of every entry.
+ * */
+static void Cache_Prune(const std::string& dir) {
+  time_t now = time(0);
+  std::string stamp = dir+"/.pruned";
+  struct stat info;
+  if(stat(stamp.data(),&info) == 0 && now-info.st_mtime < 24*60*60) {
+    return;
+  }
+  int fd = open(stamp.data(),O_WRONLY | O_CREAT | O_NOFOLLOW,0600);
+  if(fd < 0) {
+    return;
+  }
+  close(fd);
+  utime(stamp.data(),0);
+  DIR* list = opendir(dir.data());
+  if(list == 0) {
+    return;
+  }
+  struct dirent* entry;
+  while((entry = readdir(list)) != 0) {
+    if(entry->d_name[0] == '.') {
+      continue;
+    }
+    std::string path = dir+"/"+entry->d_name;
+    if(lstat(path.data(),&info) != 0 || !S_ISREG(info.st_mode)) {
+      continue;
+    }
+    bool stale = now-info.st_mtime > CODE_CACHE_MAX_AGE;
+    if(!stale && strstr(entry->d_name,".tmp")) {
+      stale = now-info.st_mtime > 60*60;
+    }else if(!stale) {
+      CacheHeader header;
+      FILE* fp = fopen(path.data(),"rb");
+      stale = fp == 0 || fread(&header,sizeof(header),1,fp) != 1 || header.magic != CODE_CACHE_MAGIC || header.version != CODE_CACHE_VERSION || header.runtime != Cache_RuntimeHash();
+      if(fp) {
+	fclose(fp);
+      }
+    }
+    if(stale) {
+      unlink(path.data());
+    }
+  }
+  closedir(list);
+}
+/**
+ * @summary Retrieves the directory of the code cache, CODE_CACHE_DIR in the cache directory of the user, creating it (private to the user) on first use.
+ * The first call comes from main, before any thread compiles.
+ * @returns The absolute path of the directory, or an empty string if there is no directory only the user can write to (which turns the cache off)
+ * */
+static const std::string& Cache_Directory() {
+  static std::string dir;
+  static bool initialized = false;
+  if(!initialized) {
+    initialized = true;
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    std::string base;
+    if(xdg && xdg[0] == '/') {
+      base = xdg;
+    }else if(home && home[0] == '/') {
+      base = std::string(home)+"/.cache";
+    }else {
+      return dir;
+    }
+    mkdir(base.data(),0700);
+    std::string path = base+"/" CODE_CACHE_DIR;
+    mkdir(path.data(),0700);
+    if(Cache_IsPrivate(path.data())) {
+      dir = path;
+      Cache_Prune(dir);
+    }
+  }
+  return dir;
+}
+#endif
+//A symbol exported by a shared object written by ELF_Write
+class ELFSymbol {
+public:
+  std::string name;
+  size_t offset; //Where the symbol is in the image
+  size_t size;
+  bool isFunction;
+};
+//Internal -- The hash function of ELF symbol tables
+static uint32_t ELF_Hash(const char* name) {
+  uint32_t hash = 0;
+  while(*name) {
+    hash = (hash << 4)+(unsigned char)*name;
+    uint32_t high = hash & 0xf0000000;
+    if(high) {
+      hash^=high >> 24;
+    }
+    hash&=~high;
+    name++;
+  }
+  return hash;
+}
+/**
+ * @summary Writes a shared object (x86-64 ELF) which can be loaded with dlopen. The image is mapped readable, writable and executable,
+ * so that whoever loads it can patch it in place; it needs no relocations from the dynamic linker.
+ * @param image The contents of the object
+ * @param symbols The symbols the object exports, which dlsym finds
+ * @returns False if the file could not be written
+ * */
+static bool ELF_Write(const char* path, const std::vector<unsigned char>& image, const std::vector<ELFSymbol>& symbols) {
+  //Dynamic symbol and string tables (the first symbol is always the undefined one)
+  std::string dynstr(1,'\0');
+  std::vector<Elf64_Sym> dynsym(symbols.size()+1);
+  memset(dynsym.data(),0,dynsym.size()*sizeof(Elf64_Sym));
+  size_t soname = dynstr.size();
+  const char* filename = strrchr(path,'/') ? strrchr(path,'/')+1 : path;
+  dynstr+=filename;
+  dynstr.push_back('\0');
+  for(size_t i = 0;i<symbols.size();i++) {
+    Elf64_Sym& sym = dynsym[i+1];
+    sym.st_name = (Elf64_Word)dynstr.size();
+    dynstr+=symbols[i].name;
+    dynstr.push_back('\0');
+    sym.st_info = ELF64_ST_INFO(STB_GLOBAL,symbols[i].isFunction ? STT_FUNC : STT_OBJECT);
+    sym.st_other = STV_DEFAULT;
+    sym.st_shndx = 5; //.text
+    sym.st_size = symbols[i].size;
+  }
+  //Hash table, which dlsym uses to look symbols up
+  std::vector<Elf64_Word> hash;
+  Elf64_Word bucketCount = (Elf64_Word)(symbols.size() ? symbols.size() : 1);
+  hash.push_back(bucketCount);
+  hash.push_back((Elf64_Word)dynsym.size());
+  hash.resize(2+bucketCount+dynsym.size(),0);
+  Elf64_Word* buckets = hash.data()+2;
+  Elf64_Word* chains = buckets+bucketCount;
+  for(size_t i = 1;i<dynsym.size();i++) {
+    Elf64_Word bucket = ELF_Hash(symbols[i-1].name.data()) % bucketCount;
+    chains[i] = buckets[bucket];
+    buckets[bucket] = (Elf64_Word)i;
+  }
+  //Layout: headers, .hash, .dynsym, .dynstr, .dynamic and .text are loaded (at the address of their offset); .shstrtab and the section headers are not
+  size_t phoff = sizeof(Elf64_Ehdr);
+  size_t hashOff = phoff+3*sizeof(Elf64_Phdr);
+  size_t symOff = (hashOff+hash.size()*sizeof(Elf64_Word)+7) & ~(size_t)7;
+  size_t strOff = symOff+dynsym.size()*sizeof(Elf64_Sym);
+  size_t dynOff = (strOff+dynstr.size()+7) & ~(size_t)7;
+  Elf64_Dyn dynamic[7];
+  size_t textOff = (dynOff+sizeof(dynamic)+15) & ~(size_t)15;
+  size_t loadEnd = textOff+image.size();
+  const char shstrtab[] = "\0.hash\0.dynsym\0.dynstr\0.dynamic\0.text\0.shstrtab";
+  size_t shstrOff = loadEnd;
+  size_t shOff = (shstrOff+sizeof(shstrtab)+7) & ~(size_t)7;
+  std::vector<unsigned char> file(shOff+7*sizeof(Elf64_Shdr),0);
+  for(size_t i = 1;i<dynsym.size();i++) {
+    dynsym[i].st_value = textOff+symbols[i-1].offset;
+  }
+  Elf64_Sxword tags[] = {DT_HASH,DT_STRTAB,DT_SYMTAB,DT_STRSZ,DT_SYMENT,DT_SONAME,DT_NULL};
+  Elf64_Xword values[] = {hashOff,strOff,symOff,dynstr.size(),sizeof(Elf64_Sym),soname,0};
+  for(size_t i = 0;i<7;i++) {
+    dynamic[i].d_tag = tags[i];
+    dynamic[i].d_un.d_val = values[i];
+  }
+  
+  Elf64_Ehdr* header = (Elf64_Ehdr*)file.data();
+  memcpy(header->e_ident,ELFMAG,SELFMAG);
+  header->e_ident[EI_CLASS] = ELFCLASS64;
+  header->e_ident[EI_DATA] = ELFDATA2LSB;
+  header->e_ident[EI_VERSION] = EV_CURRENT;
+  header->e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  header->e_type = ET_DYN;
+  header->e_machine = EM_X86_64;
+  header->e_version = EV_CURRENT;
+  header->e_phoff = phoff;
+  header->e_shoff = shOff;
+  header->e_ehsize = sizeof(Elf64_Ehdr);
+  header->e_phentsize = sizeof(Elf64_Phdr);
+  header->e_phnum = 3;
+  header->e_shentsize = sizeof(Elf64_Shdr);
+  header->e_shnum = 7;
+  header->e_shstrndx = 6;
+  
+  Elf64_Phdr* segments = (Elf64_Phdr*)(file.data()+phoff);
+  segments[0].p_type = PT_LOAD;
+  segments[0].p_flags = PF_R | PF_W | PF_X;
+  segments[0].p_filesz = loadEnd;
+  segments[0].p_memsz = loadEnd;
+  segments[0].p_align = 4096;
+  segments[1].p_type = PT_DYNAMIC;
+  segments[1].p_flags = PF_R | PF_W;
+  segments[1].p_offset = dynOff;
+  segments[1].p_vaddr = dynOff;
+  segments[1].p_paddr = dynOff;
+  segments[1].p_filesz = sizeof(dynamic);
+  segments[1].p_memsz = sizeof(dynamic);
+  segments[1].p_align = 8;
+  //Without this, the dynamic linker assumes the object needs an executable stack
+  segments[2].p_type = PT_GNU_STACK;
+  segments[2].p_flags = PF_R | PF_W;
+  segments[2].p_align = 16;
+  
+  memcpy(file.data()+hashOff,hash.data(),hash.size()*sizeof(Elf64_Word));
+  memcpy(file.data()+symOff,dynsym.data(),dynsym.size()*sizeof(Elf64_Sym));
+  memcpy(file.data()+strOff,dynstr.data(),dynstr.size());
+  memcpy(file.data()+dynOff,dynamic,sizeof(dynamic));
+  if(image.size()) {
+    memcpy(file.data()+textOff,image.data(),image.size());
+  }
+  memcpy(file.data()+shstrOff,shstrtab,sizeof(shstrtab));
+  
+  //Section headers, for the benefit of tools like readelf and nm
+  Elf64_Shdr* sections = (Elf64_Shdr*)(file.data()+shOff);
+  Elf64_Word names[] = {0,1,7,15,23,32,38};
+  Elf64_Word types[] = {SHT_NULL,SHT_HASH,SHT_DYNSYM,SHT_STRTAB,SHT_DYNAMIC,SHT_PROGBITS,SHT_STRTAB};
+  size_t offsets[] = {0,hashOff,symOff,strOff,dynOff,textOff,shstrOff};
+  size_t sizes[] = {0,hash.size()*sizeof(Elf64_Word),dynsym.size()*sizeof(Elf64_Sym),dynstr.size(),sizeof(dynamic),image.size(),sizeof(shstrtab)};
+  for(size_t i = 1;i<7;i++) {
+    sections[i].sh_name = names[i];
+    sections[i].sh_type = types[i];
+    sections[i].sh_offset = offsets[i];
+    sections[i].sh_size = sizes[i];
+    if(i<6) {
+      sections[i].sh_addr = offsets[i];
+      sections[i].sh_flags = SHF_ALLOC;
+    }
+  }
+  sections[1].sh_link = 2;
+  sections[1].sh_entsize = sizeof(Elf64_Word);
+  sections[1].sh_addralign = 8;
+  sections[2].sh_link = 3;
+  sections[2].sh_info = 1; //Index of the first global symbol
+  sections[2].sh_entsize = sizeof(Elf64_Sym);
+  sections[2].sh_addralign = 8;
+  sections[3].sh_addralign = 1;
+  sections[4].sh_flags|=SHF_WRITE;
+  sections[4].sh_link = 3;
+  sections[4].sh_entsize = sizeof(Elf64_Dyn);
+  sections[4].sh_addralign = 8;
+  sections[5].sh_flags|=SHF_WRITE | SHF_EXECINSTR;
+  sections[5].sh_addralign = 16;
+  sections[6].sh_addralign = 1;
+  
+  FILE* fp = fopen(path,"wb");
+  if(fp == 0) {
+    return false;
+  }
+  bool ok = fwrite(file.data(),1,file.size(),fp) == file.size();
+  return fclose(fp) == 0 && ok;
+}
 
 //END PLATFORM CODE
 
@@ -81,6 +538,88 @@ public:
   }
   
 };
+//Internal -- Appends bytes to a buffer
+static void Buffer_Append(std::vector<unsigned char>& out, const void* data, size_t len) {
+  out.insert(out.end(),(const unsigned char*)data,(const unsigned char*)data+len);
+}
+template<typename T>
+static void Buffer_Append(std::vector<unsigned char>& out, const T& val) {
+  Buffer_Append(out,&val,sizeof(val));
+}
+
+/**
+ * @summary A bump allocator. Memory is carved out of large blocks and given back all at once, by Release.
+ * Destructors are never run, so only objects which do not own anything else (like parse tree nodes) belong in one.
+ * */
+class Arena {
+public:
+  std::vector<unsigned char*> blocks;
+  unsigned char* ptr; //Next free byte in the current block
+  size_t left; //Free bytes in the current block
+  Arena() {
+    ptr = 0;
+    left = 0;
+  }
+  void* Allocate(size_t size, size_t align) {
+    size_t pad = (align-((size_t)ptr & (align-1))) & (align-1);
+    if(pad+size > left) {
+      size_t blockSize = std::max(size+align,(size_t)ARENA_BLOCK_SIZE);
+      ptr = new unsigned char[blockSize];
+      blocks.push_back(ptr);
+      left = blockSize;
+      pad = (align-((size_t)ptr & (align-1))) & (align-1);
+    }
+    void* retval = ptr+pad;
+    ptr+=pad+size;
+    left-=pad+size;
+    return retval;
+  }
+  //Allocates an array of default-constructed elements
+  template<typename T>
+  T* AllocateArray(size_t count) {
+    T* retval = (T*)Allocate(sizeof(T)*count,alignof(T));
+    for(size_t i = 0;i<count;i++) {
+      new(retval+i) T();
+    }
+    return retval;
+  }
+  //Frees everything allocated so far
+  void Release() {
+    for(size_t i = 0;i<blocks.size();i++) {
+      delete[] blocks[i];
+    }
+    blocks.clear();
+    ptr = 0;
+    left = 0;
+  }
+  ~Arena() {
+    Release();
+  }
+};
+//A fixed-size array which lives in an Arena
+template<typename T>
+class ArenaArray {
+public:
+  T* items;
+  size_t count;
+  ArenaArray() {
+    items = 0;
+    count = 0;
+  }
+  ArenaArray(Arena& arena, size_t count) {
+    this->items = arena.AllocateArray<T>(count);
+    this->count = count;
+  }
+  size_t size() const {
+    return count;
+  }
+  T& operator[](size_t i) {
+    return items[i];
+  }
+  const T& operator[](size_t i) const {
+    return items[i];
+  }
+};
 
 
 class UALModule; //forward-declaration
@@ -105,152 +644,84 @@ public:
 
 
 
-typedef struct {
-  size_t count; //The number of elements in the array
-  size_t stride; //The size of each element in the array (in bytes), or zero if array of objects
-} GC_Array_Header;
-
-typedef struct {
-  uint32_t length;
-} GC_String_Header;
-
-
-/**
- * @summary Reads white space
- * @param found True if whitespace was found, false otherwise
- * @returns The string up to the whitespace
- * */
-static std::string Parser_ExpectWhitespace(const char*& str, bool& found) {
-  std::string retval; //std::string is slow. We could optimize this; but assembly loading/JITting or interpreting is expected to be slow at initial load with most runtimes. Performance shouldn't matter too much at early loading stage.
-  found = false;
-  while(*str != 0) {
-    if(isspace(*str)) {
-      while(isspace(*str)){str++;}
-      found = true;
-      return retval;
-    }else {
-      retval+=*str;
-    }
-    str++;
-  }
-  return retval;
-}
-
-/**
- * @summary Expects a specific character
- * @param acter The character to expect
- * @param found True if the specified character was found, false otherwise.
- * @returns The text up to the specified character
- * */
-static std::string Parser_ExpectChar(const char*& str, char acter, bool& found) {
-  std::string retval;
-  while(*str != 0) {
-    if(*str == acter) {
-      str++;
-      return retval;
-    }
-    retval+=*str;
-    str++;
-  }
-  return retval;
-}
-
+//GC_Array_Header and GC_String_Header are in UALExtension.h, since native extensions use them too
 
-/**
- * @summary Expects a list of characters
- * @param acters A list of characters to search for, followed by a NULL terminator
- * @param found The memory address of the character which was found, or NULL if the character was not found.
- * @returns The text up to the specified character
- * */
-static std::string Parser_ExpectMultiChar(const char*& str, const char* acters, const char*& found) {
-  std::string retval;
-  found = 0;
-  while(*str != 0) {
-    const char* current = acters;
-    while(*current != 0) {
-    if(*str == *current) {
-      found = str;
-      str++;
-      return retval;
-    }
-    current++;
-    }
-    retval+=*str;
-    str++;
-  }
-  return retval;
-}
 
 /**
- * @summary Expects a string
- * @param acter The string to expect
- * @param _found True if the specified string was found, false otherwise.
- * @returns The text up to the specified string
+ * Interned type handle. Every type name seen by the runtime is assigned a compact ID exactly once,
+ * so type checks in the parser and emitter are integer compares rather than string compares.
  * */
-static std::string Parser_ExpectString(const char*& str, const char* acter, bool& found) {
-  std::string retval;
-  while(*str != 0) {
-    if(*str == acter[0]) {
-      const char* cpos = acter;
-      found = true;
-      while(*str != 0) {
-	if(*cpos == 0) {
-	  //Found whole string
-	  found = true;
-	  return retval;
-	}
-	if(*str != *cpos) {
-	  found = false;
-	  break;
-	}
-	str++;
-	cpos++;
-      }
-      str++;
-      return retval;
-    }
-    retval+=*str;
-    str++;
-  }
-  return retval;
-}
-
+typedef uint32_t TypeID;
+//Well-known types. These are always interned first, in this order.
+enum BuiltinTypeID {
+  TVoid, TInt32, TDouble, TString, TBlob
+};
+TypeID InternType(const char* name);
+const char* TypeName(TypeID id);
 
+class UALMethod;
 /**
- * Contains information about a method signature
+ * Contains information about a method signature (<return type> <class>::<method>(<argument type>,...)).
+ * Signatures are interned (see InternSignature): each is parsed once, and every reference to a method shares its MethodSignature.
  * */
 class MethodSignature {
 public:
   std::string fullSignature;
-  std::string returnType; //Return type of method
+  TypeID returnType; //Return type of method
   std::string className; //Fully-qualified class name of method
   std::string methodName;
-  std::vector<std::string> args;
-  MethodSignature() {
-  }
+  std::vector<TypeID> args;
+  UALMethod* method; //The method with this signature, once it has been loaded (NULL until then)
   MethodSignature(const char* rawName) {
     fullSignature = rawName;
-    bool found;
-   returnType = Parser_ExpectWhitespace(rawName,found);
-   className = Parser_ExpectString(rawName,"::",found);
-   methodName = Parser_ExpectChar(rawName,'(',found);
-   
-   while(true) {
-     const char* foundChar;
-     std::string argType = Parser_ExpectMultiChar(rawName,",)",foundChar);
-     if(argType.size()) {
-      args.push_back(argType);
-     }
-     if(*foundChar == ')') {
-       //End of arguments
-       break;
-     }
-   }
-  }
-  bool operator<(const MethodSignature& other) const {
-    return other.fullSignature<fullSignature;
+    method = 0;
+    const char* ptr = rawName;
+    while(*ptr != 0 && !isspace(*ptr)) {
+      ptr++;
+    }
+    returnType = InternType(std::string(rawName,ptr).data());
+    while(isspace(*ptr)) {
+      ptr++;
+    }
+    const char* scope = strstr(ptr,"::");
+    const char* open = scope ? strchr(scope+2,'(') : 0;
+    if(open == 0) {
+      throw "Malformed UAL. Bad method signature.";
+    }
+    className.assign(ptr,scope);
+    methodName.assign(scope+2,open);
+    ptr = open+1;
+    while(true) {
+      const char* end = ptr+strcspn(ptr,",)");
+      if(*end == 0) {
+	throw "Malformed UAL. Bad method signature.";
+      }
+      if(end != ptr) {
+	args.push_back(InternType(std::string(ptr,end).data()));
+      }
+      if(*end == ')') {
+	//End of arguments
+	break;
+      }
+      ptr = end+1;
+    }
   }
 };
+static std::unordered_map<std::string,MethodSignature*> signatureTable; //Full signature -> interned signature
+/**
+ * @summary Interns a method signature
+ * @param rawName The full signature of the method
+ * @returns The parsed signature. The same signature always yields the same MethodSignature, whether or not the method has been loaded yet.
+ * */
+static MethodSignature* InternSignature(const char* rawName) {
+  auto it = signatureTable.find(rawName);
+  if(it != signatureTable.end()) {
+    return it->second;
+  }
+  MethodSignature* retval = new MethodSignature(rawName);
+  signatureTable[retval->fullSignature] = retval;
+  return retval;
+}
 
 
 
@@ -363,29 +834,382 @@ public:
   Type* type;
 };
 
-class UALMethod;
 static UALMethod* ResolveMethod(void* assembly, uint32_t handle);
-static std::map<std::string,void*> abi_ext;
+static UALMethod* FindMethod(const std::string& signature);
+static std::vector<UALMethod*> profiledMethods; //Methods whose native code counts calls and branches (see Profile_Dump)
+static std::mutex profileLock;
+static bool AOT_Building = false; //Whether or not the module is being compiled ahead of time (see UALModule::SaveNative)
+thread_local std::vector<UALMethod*> stubQueue; //Methods which are called through a stub from the code this thread is compiling, but have no stub yet
+static std::mutex constantPoolLock; //Serializes GC allocations for constant pools, which may be made while compiling on several threads
+//The C type of a parameter (or of the return value) of a native function
+enum NativeType {
+  NativeVoid = UAL_TYPE_VOID,
+  NativeInt = UAL_TYPE_INT, //int (System.Int32)
+  NativeDouble = UAL_TYPE_DOUBLE, //double (System.Double), passed in an XMM register
+  NativePointer = UAL_TYPE_POINTER, //Any object, as a pointer
+  NativeString = UAL_TYPE_STRING, //GC_String_Header* (System.String)
+  NativeArray = UAL_TYPE_ARRAY //GC_Array_Header*
+};
+template<typename T>
+struct NativeTypeOf;
+template<>
+struct NativeTypeOf<void> { static const NativeType value = NativeVoid; };
+template<>
+struct NativeTypeOf<int> { static const NativeType value = NativeInt; };
+template<>
+struct NativeTypeOf<double> { static const NativeType value = NativeDouble; };
+template<>
+struct NativeTypeOf<void*> { static const NativeType value = NativePointer; };
+template<>
+struct NativeTypeOf<GC_String_Header*> { static const NativeType value = NativeString; };
+template<>
+struct NativeTypeOf<GC_Array_Header*> { static const NativeType value = NativeArray; };
+//Whether or not a native type can carry a UAL type
+static bool Native_Matches(NativeType native, TypeID type) {
+  switch(native) {
+    case NativeVoid:
+      return type == TVoid;
+    case NativeInt:
+      return type == TInt32;
+    case NativeDouble:
+      return type == TDouble;
+    case NativeString:
+      return type == TString;
+    case NativeArray:
+    {
+      //Arrays (System.String[] and the like), and System.Blob, which is laid out like an array of bytes
+      const char* name = TypeName(type);
+      size_t len = strlen(name);
+      return type == TBlob || (len > 2 && strcmp(name+len-2,"[]") == 0);
+    }
+    case NativePointer:
+      //Any object
+      return type != TVoid && type != TInt32 && type != TDouble;
+    default:
+      return false;
+  }
+}
+//A native function which UAL code can call, with its C signature (see Native_Register)
+class NativeFunction {
+public:
+  void* func;
+  NativeType returnType;
+  std::vector<NativeType> args;
+  void* trampoline; //See Native_Trampoline
+};
+//Native functions by name; entries never move once registered, so methods keep pointers to them.
+static std::map<std::string,NativeFunction> abi_ext;
+/**
+ * @summary Registers a native function which UAL code can call by name
+ * @param returnType The C type of the return value
+ * @param args The C types of the parameters
+ * */
+static void Native_Register(const char* name, void* func, NativeType returnType, const std::vector<NativeType>& args) {
+  NativeFunction& native = abi_ext[name];
+  native.func = func;
+  native.returnType = returnType;
+  native.args = args;
+  native.trampoline = 0;
+}
+//Internal -- UAL_Runtime::Register
+static int Extension_Register(const char* name, void* func, UAL_Type returnType, const UAL_Type* args, size_t argCount) {
+  if(name == 0 || func == 0 || returnType > UAL_TYPE_ARRAY) {
+    return 0;
+  }
+  std::vector<NativeType> types;
+  for(size_t i = 0;i<argCount;i++) {
+    if(args[i] == UAL_TYPE_VOID || args[i] > UAL_TYPE_ARRAY) {
+      return 0;
+    }
+    types.push_back((NativeType)args[i]);
+  }
+  Native_Register(name,func,(NativeType)returnType,types);
+  return 1;
+}
+//Internal -- UAL_Runtime::AddRoot and RemoveRoot
+static void Extension_AddRoot(void** variable) {
+  GC_Mark(variable,true);
+}
+static void Extension_RemoveRoot(void** variable) {
+  GC_Unmark(variable,true);
+}
+/**
+ * @summary Loads a native extension library (see UALExtension.h), which registers functions UAL code can call
+ * @returns False if the library could not be loaded, or failed to initialize
+ * */
+static bool Extension_Load(const char* path) {
+  std::string filename = path;
+  if(filename.find('/') == std::string::npos) {
+    filename = "./"+filename; //Otherwise dlopen searches the library path
+  }
+  void* handle = dlopen(filename.data(),RTLD_NOW | RTLD_LOCAL);
+  if(handle == 0) {
+    printf("Error: %s\n",dlerror());
+    return false;
+  }
+  dlerror();
+  UAL_ExtensionInitFunc init = (UAL_ExtensionInitFunc)dlsym(handle,"UAL_ExtensionInit");
+  if(init == 0) {
+    const char* error = dlerror();
+    printf("Error: %s is not a UAL extension (%s).\n",path,error ? error : "UAL_ExtensionInit is NULL");
+    return false;
+  }
+  static const UAL_Runtime runtime = {UAL_EXTENSION_ABI_VERSION,Extension_Register,Extension_AddRoot,Extension_RemoveRoot};
+  if(init(&runtime) != 0) {
+    printf("Error: %s failed to initialize.\n",path);
+    return false;
+  }
+  return true;
+}
+//Registers a native function, with the C signature it was declared with
+template<typename R, typename... A>
+static void Native_Register(const char* name, R(*func)(A...)) {
+  Native_Register(name,(void*)func,NativeTypeOf<R>::value,std::vector<NativeType>({NativeTypeOf<A>::value...}));
+}
+/**
+ * @summary Retrieves the trampoline of a native function, emitting it on first use. The trampoline takes the arguments encoded like they are in JIT code
+ * (see Native_Call), passes each the way the C signature wants it (doubles in XMM registers), and encodes the return value the same way.
+ * @returns The trampoline (uint64_t(const uint64_t* args))
+ * */
+static void* Native_Trampoline(NativeFunction* native) {
+  if(native->trampoline) {
+    return native->trampoline;
+  }
+  JIT_EnsureContext();
+  asmjit::FuncBuilderX builder;
+  builder.setRet(asmjit::kVarTypeIntPtr);
+  builder.addArg(asmjit::kVarTypeIntPtr);
+  JITCompiler->addFunc(builder);
+  asmjit::X86GpVar args = JITCompiler->newIntPtr();
+  JITCompiler->setArg(0,args);
+  asmjit::FuncBuilderX target;
+  std::vector<asmjit::X86GpVar> gpArgs(native->args.size());
+  std::vector<asmjit::X86XmmVar> xmmArgs(native->args.size());
+  for(size_t i = 0;i<native->args.size();i++) {
+    asmjit::X86Mem slot = JITCompiler->intptr_ptr(args,(int32_t)(i*sizeof(uint64_t)));
+    if(native->args[i] == NativeDouble) {
+      target.addArg(asmjit::kVarTypeFp64);
+      xmmArgs[i] = JITCompiler->newXmmSd();
+      JITCompiler->movsd(xmmArgs[i],slot);
+    }else {
+      target.addArg(asmjit::kVarTypeIntPtr);
+      gpArgs[i] = JITCompiler->newIntPtr();
+      JITCompiler->mov(gpArgs[i],slot);
+    }
+  }
+  if(native->returnType == NativeDouble) {
+    target.setRet(asmjit::kVarTypeFp64);
+  }else if(native->returnType != NativeVoid) {
+    target.setRet(asmjit::kVarTypeIntPtr);
+  }
+  //Trampolines are never cached, so they can call the function directly
+  asmjit::X86CallNode* call = JITCompiler->call((size_t)native->func,target);
+  for(size_t i = 0;i<native->args.size();i++) {
+    if(native->args[i] == NativeDouble) {
+      call->setArg(i,xmmArgs[i]);
+    }else {
+      call->setArg(i,gpArgs[i]);
+    }
+  }
+  asmjit::X86GpVar result = JITCompiler->newIntPtr();
+  switch(native->returnType) {
+    case NativeVoid:
+      JITCompiler->xor_(result,result);
+      break;
+    case NativeDouble:
+    {
+      asmjit::X86XmmVar value = JITCompiler->newXmmSd();
+      call->setRet(0,value);
+      JITCompiler->movq(result,value);
+    }
+      break;
+    case NativeInt:
+      call->setRet(0,result);
+      JITCompiler->movsxd(result,result.r32());
+      break;
+    default:
+      call->setRet(0,result);
+  }
+  JITCompiler->ret(result);
+  JITCompiler->endFunc();
+  JITCompiler->finalize();
+  std::lock_guard<std::mutex> guard(JITruntimeLock);
+  native->trampoline = JITAssembler->make();
+  return native->trampoline;
+}
+
+//When console output gets written out
+enum ConsoleBuffering {
+  ConsoleUnbuffered, //After every write
+  ConsoleLineBuffered, //After every line (the default on a terminal)
+  ConsoleBlockBuffered //Whenever the buffer fills up (the default otherwise)
+};
+static ConsoleBuffering consoleBuffering = isatty(1) ? ConsoleLineBuffered : ConsoleBlockBuffered;
+//Internal -- Writes all of a list of buffers to a file descriptor, across partial writes
+static bool Console_WriteAll(int fd, struct iovec* parts, int count) {
+  while(count) {
+    ssize_t written = writev(fd,parts,count);
+    if(written < 0) {
+      if(errno == EINTR) {
+	continue;
+      }
+      return false;
+    }
+    while(count && (size_t)written >= parts->iov_len) {
+      written-=parts->iov_len;
+      parts++;
+      count--;
+    }
+    if(count) {
+      parts->iov_base = (char*)parts->iov_base+written;
+      parts->iov_len-=written;
+    }
+  }
+  return true;
+}
+/**
+ * @summary The console output of a thread. It collects in a buffer, and goes straight to standard output with write/writev (bypassing stdio and its locks).
+ * What the runtime prints itself still goes through stdio, after Console_Sync has written out the buffer of the thread.
+ * */
+class ConsoleBuffer {
+public:
+  char* data;
+  size_t used;
+  ConsoleBuffer() {
+    data = new char[CONSOLE_BUFFER_SIZE];
+    used = 0;
+  }
+  ~ConsoleBuffer() {
+    Flush();
+    delete[] data;
+  }
+  //Internal -- Writes out the buffer, followed by more bytes, in a single system call
+  void Write(const char* bytes, size_t len) {
+    struct iovec parts[2];
+    int count = 0;
+    if(used) {
+      parts[count].iov_base = data;
+      parts[count].iov_len = used;
+      count++;
+    }
+    if(len) {
+      parts[count].iov_base = (void*)bytes;
+      parts[count].iov_len = len;
+      count++;
+    }
+    if(count == 0) {
+      return;
+    }
+    fflush(stdout);
+    Console_WriteAll(1,parts,count);
+    used = 0;
+  }
+  void Flush() {
+    Write(0,0);
+  }
+  void Append(const char* bytes, size_t len) {
+    if(len > CONSOLE_BUFFER_SIZE-used) {
+      Write(bytes,len);
+      return;
+    }
+    memcpy(data+used,bytes,len);
+    used+=len;
+    if(consoleBuffering == ConsoleUnbuffered || (consoleBuffering == ConsoleLineBuffered && memchr(bytes,'\n',len))) {
+      Flush();
+    }
+  }
+};
+//Constructed on first use by each thread, and flushed when the thread (or the process) exits
+static thread_local ConsoleBuffer consoleOut;
 
 static void ConsoleOut(GC_String_Header* str) {
   const char* mander = GC_String_Cstr(str); //Charmander is a constant. Always.
-  printf("%s",mander);
+  consoleOut.Append(mander,str->length);
 }
-static void PrintDouble(uint64_t encoded) { //Print a double on the double.
-  double onthe = *(double*)&encoded;
-  printf("%f\n",onthe);
+static void PrintDouble(double onthe) { //Print a double on the double.
+  char mander[512]; //%f prints every digit in front of the point; 1e308 takes 316 characters
+  int len = snprintf(mander,sizeof(mander),"%f\n",onthe);
+  consoleOut.Append(mander,std::min((size_t)len,sizeof(mander)-1));
 }
 
 static void PrintInt(int eger) {
-  printf("%i",eger);
+  char mander[16];
+  char* end = mander+sizeof(mander);
+  char* digit = end;
+  unsigned int value = eger < 0 ? 0u-(unsigned int)eger : (unsigned int)eger;
+  do {
+    *--digit = '0'+value % 10;
+    value/=10;
+  }while(value);
+  if(eger < 0) {
+    *--digit = '-';
+  }
+  consoleOut.Append(digit,end-digit);
+}
+static void ConsoleFlush() {
+  consoleOut.Flush();
+}
+//0 for unbuffered, 1 for line buffered, 2 for block buffered output (see ConsoleBuffering)
+static void ConsoleSetBuffering(int mode) {
+  if(mode >= ConsoleUnbuffered && mode <= ConsoleBlockBuffered) {
+    consoleBuffering = (ConsoleBuffering)mode;
+  }
+  if(consoleBuffering == ConsoleUnbuffered) {
+    consoleOut.Flush();
+  }
+}
+//Internal -- Writes out the console output the calling thread has buffered. The runtime prints to stdout and stderr directly, so it does this first, to keep its messages after the output which led up to them.
+static void Console_Sync() {
+  consoleOut.Flush();
+}
+//Internal -- Reports an error which nobody caught (the runtime throws C strings), after the console output of the thread which threw it
+static void Runtime_Terminate() {
+  Console_Sync();
+  if(std::current_exception()) {
+    try {
+      throw;
+    }catch(const char* error) {
+      fprintf(stderr,"Error: %s\n",error);
+    }catch(...) {
+    }
+  }
+  abort();
+}
+//Where System.Int32 division by zero (or INT32_MIN/-1) ends up, on the interpreter and in JIT code alike
+static void Int32_DivideFault() {
+  Console_Sync();
+  fprintf(stderr,"Integer division by zero (or overflow).\n");
+  abort();
 }
 
-static void Ext_Invoke(const char* name, GC_Array_Header* args) {
-  ((void(*)(GC_Array_Header*))abi_ext[name])(args);
+/**
+ * @summary Calls native code which takes every argument (and returns its result) in a general purpose register, like JIT code does
+ * @param args The arguments, encoded like they are in JIT code (System.Int32 sign-extended, System.Double as its bits, objects as pointers)
+ * */
+static uint64_t Native_Call(void* func, const uint64_t* args, size_t count) {
+  typedef uint64_t u;
+  switch(count) {
+    case 0:
+      return ((u(*)())func)();
+    case 1:
+      return ((u(*)(u))func)(args[0]);
+    case 2:
+      return ((u(*)(u,u))func)(args[0],args[1]);
+    case 3:
+      return ((u(*)(u,u,u))func)(args[0],args[1],args[2]);
+    case 4:
+      return ((u(*)(u,u,u,u))func)(args[0],args[1],args[2],args[3]);
+    case 5:
+      return ((u(*)(u,u,u,u,u))func)(args[0],args[1],args[2],args[3],args[4]);
+    case 6:
+      return ((u(*)(u,u,u,u,u,u))func)(args[0],args[1],args[2],args[3],args[4],args[5]);
+    default:
+      throw "Too many arguments for a native call.";
+  }
 }
 
 
-Type* ResolveType(const char* name);
+Type* ResolveType(TypeID id);
 
 
 //A parse tree node
@@ -401,28 +1225,28 @@ public:
   //The type of node
   NodeType type;
   //The result type
-  std::string resultType;
+  TypeID resultType;
   //The next node
   Node* next;
   //The previous node
   Node* prev;
-  bool fpEmit; //Whether or not the expression's output should be saved to the floating point stack.
-  asmjit::Label label; //The location of the instruction in the generated assembly code
-  bool referenced; //Whether or not this label has been referenced already
+  uint32_t ualip; //Offset of the UAL instruction which produced this node
+  asmjit::Label label; //The location of the instruction in the generated assembly code (only created for branch targets)
+  bool referenced; //Whether or not anything jumps here, and so whether or not the node has a label
   bool bound; //Whether or not this label has been bound
   
   
   
   Node(NodeType type) {
     this->type = type;
+    this->resultType = TVoid;
     this->next = 0;
     this->prev = 0;
-    this->fpEmit = false;
+    this->ualip = 0;
     this->bound = false;
     this->referenced = false;	
     
-    //JITCompiler->nop();
-    label = JITCompiler->newLabel();
+    //Labels are created when the method is emitted, by the compiler of the thread which emits it
     
   }
   
@@ -434,7 +1258,7 @@ public:
   uint32_t value;
   ConstantInt(uint32_t val):Node(NodeType::NConstantInt) {
     value = val;
-    resultType = "System.Int32";
+    resultType = TInt32;
   }
 };
 //An expression representing a constant double.
@@ -443,7 +1267,7 @@ public:
   double value;
   ConstantDouble(double val):Node(NodeType::NConstantDouble) {
     this->value = val;
-    resultType = "System.Double";
+    resultType = TDouble;
   }
 };
 //An expression representing a constant string.
@@ -452,7 +1276,7 @@ public:
   const char* value;
   ConstantString(const char* val):Node(NodeType::NConstantString) {
     this->value = val;
-    resultType = "System.String";
+    resultType = TString;
   }
 };
 //An expression representing a buffer (pseudo-array intrinsic).
@@ -461,14 +1285,14 @@ public:
   size_t idx; //Index of the buffer into the constant pool
   ConstantBuffer(size_t idx):Node(NodeType::NConstantBuffer) {
     this->idx = idx;
-    this->resultType = "System.Blob";
+    this->resultType = TBlob;
   }
 };
 //An expression which loads a value from a local variable
 class LdLoc:public Node {
 public:
   size_t idx; //The index of the local field to load from
-  LdLoc(size_t idx, const char* type):Node(NodeType::NLdLoc) {
+  LdLoc(size_t idx, TypeID type):Node(NodeType::NLdLoc) {
     this->idx = idx;
     this->resultType = type;
   }
@@ -487,7 +1311,7 @@ public:
 class LdArg:public Node {
 public:
   size_t index;
-  LdArg(size_t index, const char* type):Node(NodeType::NLdArg) {
+  LdArg(size_t index, TypeID type):Node(NodeType::NLdArg) {
     this->index = index;
     this->resultType = type;
   }
@@ -510,6 +1334,40 @@ enum BranchCondition {
   Bne //Branch on not equal
   
 };
+//The condition which holds when the operands of a comparison trade places (a < b is the same as b > a)
+static BranchCondition MirrorCondition(BranchCondition condition) {
+  switch(condition) {
+    case Ble:
+      return Bge;
+    case Blt:
+      return Bgt;
+    case Bgt:
+      return Blt;
+    case Bge:
+      return Ble;
+    default:
+      return condition;
+  }
+}
+//The condition which holds exactly when another one does not (only valid for integers; NaN fails every ordered comparison)
+static BranchCondition InvertCondition(BranchCondition condition) {
+  switch(condition) {
+    case Ble:
+      return Bgt;
+    case Blt:
+      return Bge;
+    case Bgt:
+      return Ble;
+    case Bge:
+      return Blt;
+    case Beq:
+      return Bne;
+    case Bne:
+      return Beq;
+    default:
+      throw "Cannot invert an unconditional branch";
+  }
+}
 //A branch instruction
 class Branch:public Node {
 public:
@@ -533,8 +1391,8 @@ public:
 class CallNode:public Node {
 public:
   UALMethod* method;
-  std::vector<Node*> arguments;
-  CallNode(UALMethod* method, const std::vector<Node*>& arguments):Node(NodeType::NCallNode) {
+  ArenaArray<Node*> arguments; //Allocated from the arena of the calling method
+  CallNode(UALMethod* method, const ArenaArray<Node*>& arguments):Node(NodeType::NCallNode) {
     this->method = method;
     this->arguments = arguments;
   }
@@ -572,51 +1430,134 @@ public:
 
 
 
-class DeferredOperation {
+//An expression whose value can be reused by later identical expressions (see UALMethod::EliminateCommonSubexpressions)
+class AvailableExpression {
 public:
-  virtual void Run(const asmjit::X86GpVar& output) = 0;
-  virtual ~DeferredOperation(){};
+  Node* node; //The first occurrence of the expression
+  Node** slot; //The operand slot holding the first occurrence
+  Node* owner; //The instruction which evaluates the first occurrence
+  std::vector<bool> reads; //The local variables which the expression depends on
+  size_t temp; //The local variable holding the value of the expression, or -1 if none has been allocated yet
 };
-template<typename T>
-class DeferredOperationFunctor:public DeferredOperation {
+
+//A natural loop in the instruction list of a method (see UALMethod::FindLoops)
+class Loop {
 public:
-  T functor;
-DeferredOperationFunctor(const T& func):functor(func) {
-}
-  void Run(const asmjit::X86GpVar& output) {
-    functor(output);
-  }
+  Node* header; //The only instruction through which the loop can be entered
+  std::set<Node*> body; //Every instruction in the loop, including the header and nested loops
+  Loop* parent; //The innermost loop which contains this one, or NULL
+  size_t depth; //Nesting depth (1 for outermost loops)
 };
 
-template<typename T>
+
+//What an entry of an import table points at
+enum ImportKind {
+  ImportConstantPool, //The variable holding the address of the constant pool of the method
+  ImportNative, //An abi_ext function
+  ImportEntry, //The entry of a managed method
+  ImportRuntime, //A function of the runtime itself (see Runtime_Symbol)
+  ImportProfile //The profile counters of the method; the symbol lists the UAL offsets of its conditional branches
+};
+//An address which JIT code loads from the import table at the end of its method, so that the code itself does not depend on where anything lives (and can be cached)
+class Import {
+public:
+  ImportKind kind;
+  std::string symbol;
+  void* address;
+};
+//Internal -- Resolves the functions of the runtime which JIT code calls
+static void* Runtime_Symbol(const std::string& name) {
+  if(name == "GC_Mark") {
+    return (void*)&GC_Mark;
+  }
+  if(name == "GC_Unmark") {
+    return (void*)&GC_Unmark;
+  }
+  if(name == "Int32_DivideFault") {
+    return (void*)&Int32_DivideFault;
+  }
+  return 0;
+}
+
+class DeferredOperation {
+public:
+  virtual void Run(const asmjit::X86GpVar& output) = 0;
+  virtual ~DeferredOperation(){};
+};
+template<typename T>
+class DeferredOperationFunctor:public DeferredOperation {
+public:
+  T functor;
+DeferredOperationFunctor(const T& func):functor(func) {
+}
+  void Run(const asmjit::X86GpVar& output) {
+    functor(output);
+  }
+};
+
+template<typename T>
 static DeferredOperation* MakeDeferred(const T& functor) {
   return new DeferredOperationFunctor<T>(functor);
 }
 
 
 
+/**
+ * @summary Maps the offset of each UAL instruction in a method to the node it produced.
+ * Offsets index the table directly (one slot per byte of bytecode), so a lookup is a bounds check and a load.
+ * */
+class UALOffsetTable {
+public:
+  Node** slots;
+  size_t count;
+  UALOffsetTable() {
+    slots = 0;
+    count = 0;
+  }
+  //Makes room for a method with count bytes of bytecode
+  void Reset(Arena& arena, size_t count) {
+    this->slots = arena.AllocateArray<Node*>(count);
+    this->count = count;
+  }
+  //Retrieves the node at an offset, or NULL if no instruction starts there
+  Node* Find(uint32_t offset) const {
+    return offset<count ? slots[offset] : 0;
+  }
+  void Set(uint32_t offset, Node* node) {
+    if(offset>=count) {
+      throw "sideways";
+    }
+    slots[offset] = node;
+  }
+  void Clear() {
+    slots = 0;
+    count = 0;
+  }
+};
+
 class UALMethod {
 public:
   BStream str; //The UAL bytecode for the method
+  BStream definition; //The method as it was loaded, including the header in front of its bytecode
   bool isManaged; //Whether or not this method is managed
   void* assembly; //The UAL assembly in which this method resides
-  MethodSignature sig; //The method signature
+  MethodSignature* sig; //The method signature (interned; shared with every reference to this method)
   uint32_t localVarCount; //The number of local variables in this function
-  std::vector<std::string> locals;
+  uint32_t declaredLocalCount; //The number of local variables the UAL declares; the optimizer adds its temporaries after them (see NewLocal)
+  std::vector<TypeID> locals;
   //asmjit::X86Compiler* JITCompiler;
   
   //BEGIN Optimization engine:
-  std::vector<Node*> nodes;
+  Arena arena; //Holds the parse tree, and whatever else only lives until the method has been emitted (see ReleaseTree)
     std::vector<Node*> stack;
   Node* instructions;
   Node* lastInstruction;
-  std::map<uint32_t,Node*> ualOffsets;
+  UALOffsetTable ualOffsets;
   asmjit::X86GpVar* arg_regs;
   template<typename T, typename... arg>
   //Adds an Instruction node to the tree
   T* Node_Instruction(arg... uments) {
-    T* retval = new T(uments...);
-    nodes.push_back(retval);
+    T* retval = new(arena.Allocate(sizeof(T),alignof(T))) T(uments...);
     if(instructions == 0) {
       instructions = retval;
       lastInstruction = retval;
@@ -625,24 +1566,25 @@ public:
       retval->prev = lastInstruction;
       lastInstruction = retval;
     }
-    if(ualOffsets.find(this->ualip) != ualOffsets.end()) {
+    if(ualOffsets.Find(this->ualip)) {
       printf("ERROR: Insanity.\n");
       throw "sideways";
     }
-    ualOffsets[this->ualip] = retval;
+    ualOffsets.Set(this->ualip,retval);
+    retval->ualip = this->ualip;
     return retval;
   }
   template<typename T, typename... arg>
   T* Node_Stackop(arg... uments) {
-    T* retval = new T(uments...);
-    nodes.push_back(retval);
+    T* retval = new(arena.Allocate(sizeof(T),alignof(T))) T(uments...);
     stack.push_back(retval);
     
-    if(ualOffsets.find(this->ualip) != ualOffsets.end()) {
+    if(ualOffsets.Find(this->ualip)) {
       printf("ERROR: Insanity.\n");
       throw "sideways";
     }
-    ualOffsets[this->ualip] = retval;
+    ualOffsets.Set(this->ualip,retval);
+    retval->ualip = this->ualip;
     return retval;
   }
   template<typename T>
@@ -665,26 +1607,388 @@ public:
     node->prev = 0;
     return node;
   }
+  template<typename T, typename... arg>
+  //Creates a node which is not (yet) part of the instruction list or the evaluation stack
+  T* Node_Create(arg... uments) {
+    T* retval = new(arena.Allocate(sizeof(T),alignof(T))) T(uments...);
+    return retval;
+  }
+  //Replaces an instruction node, keeping the instruction list and the UAL offset table pointing at the replacement
+  Node* Node_Replace(Node* node, Node* replacement) {
+    replacement->ualip = node->ualip;
+    if(ualOffsets.Find(node->ualip) == node) {
+      ualOffsets.Set(node->ualip,replacement);
+    }
+    replacement->prev = node->prev;
+    replacement->next = node->next;
+    if(node->prev) {
+      node->prev->next = replacement;
+    }
+    if(node->next) {
+      node->next->prev = replacement;
+    }
+    if(node == instructions) {
+      instructions = replacement;
+    }
+    if(node == lastInstruction) {
+      lastInstruction = replacement;
+    }
+    node->next = 0;
+    node->prev = 0;
+    return replacement;
+  }
+  //Retrieves the address of every operand of a node, so that passes can inspect or rewrite subtrees in place
+  static void Node_Operands(Node* node, std::vector<Node**>& output) {
+    switch(node->type) {
+      case NStLoc:
+	output.push_back(&((StLoc*)node)->exp);
+	break;
+      case NRet:
+	if(((Ret*)node)->resultExpression) {
+	  output.push_back(&((Ret*)node)->resultExpression);
+	}
+	break;
+      case NBranch:
+      {
+	Branch* b = (Branch*)node;
+	if(b->left) {
+	  output.push_back(&b->left);
+	}
+	if(b->right) {
+	  output.push_back(&b->right);
+	}
+      }
+	break;
+      case NBinaryExpression:
+      {
+	BinaryExpression* binexp = (BinaryExpression*)node;
+	output.push_back(&binexp->left);
+	if(binexp->right) {
+	  output.push_back(&binexp->right);
+	}
+      }
+	break;
+      case NCallNode:
+      {
+	CallNode* callme = (CallNode*)node;
+	for(size_t i = 0;i<callme->arguments.size();i++) {
+	  output.push_back(&callme->arguments[i]);
+	}
+      }
+	break;
+      default:
+	break;
+    }
+  }
+  //Whether or not evaluating a subtree is free of side effects. Traps count as side effects: System.Int32 division is only pure by a constant other than 0 and -1.
+  static bool Node_IsPure(Node* node) {
+    if(node->type == NCallNode) {
+      return false;
+    }
+    if(node->type == NBinaryExpression && node->resultType == TInt32 && (((BinaryExpression*)node)->op == '/' || ((BinaryExpression*)node)->op == '%')) {
+      //The divisor is the Democrat
+      Node* divisor = ((BinaryExpression*)node)->left;
+      if(divisor->type != NConstantInt || (int32_t)((ConstantInt*)divisor)->value == 0 || (int32_t)((ConstantInt*)divisor)->value == -1) {
+	return false;
+      }
+    }
+    std::vector<Node**> operands;
+    Node_Operands(node,operands);
+    for(size_t i = 0;i<operands.size();i++) {
+      if(!Node_IsPure(*operands[i])) {
+	return false;
+      }
+    }
+    return true;
+  }
+  //Whether or not two subtrees compute the same value when evaluated at the same point (assumes they are pure)
+  static bool Node_SameValue(Node* a, Node* b) {
+    if(a->type != b->type || a->resultType != b->resultType) {
+      return false;
+    }
+    switch(a->type) {
+      case NLdLoc:
+	return ((LdLoc*)a)->idx == ((LdLoc*)b)->idx;
+      case NLdArg:
+	return ((LdArg*)a)->index == ((LdArg*)b)->index;
+      case NConstantInt:
+	return ((ConstantInt*)a)->value == ((ConstantInt*)b)->value;
+      case NConstantDouble:
+	return memcmp(&((ConstantDouble*)a)->value,&((ConstantDouble*)b)->value,sizeof(double)) == 0;
+      case NBinaryExpression:
+      {
+	BinaryExpression* x = (BinaryExpression*)a;
+	BinaryExpression* y = (BinaryExpression*)b;
+	if(x->op != y->op || !Node_SameValue(x->left,y->left)) {
+	  return false;
+	}
+	if(x->right == 0 || y->right == 0) {
+	  return x->right == y->right;
+	}
+	return Node_SameValue(x->right,y->right);
+      }
+      default:
+	return false;
+    }
+  }
+  std::set<Node*> branchTargets; //Nodes which are the destination of a Branch
+  //Recomputes branchTargets from the current instruction list
+  void FindBranchTargets() {
+    branchTargets.clear();
+    for(Node* inst = instructions;inst != 0;inst = inst->next) {
+      if(inst->type == NBranch) {
+	Node* target = ualOffsets.Find(((Branch*)inst)->offset);
+	if(target) {
+	  branchTargets.insert(target);
+	}
+      }
+    }
+    if(isOSR) {
+      //Where the interpreted activation comes in
+      Node* target = ualOffsets.Find(osrOffset);
+      if(target) {
+	branchTargets.insert(target);
+      }
+    }
+  }
+  //Whether or not any node in a subtree is the destination of a Branch (and therefore must keep its label)
+  bool Node_ContainsBranchTarget(Node* node) {
+    if(branchTargets.find(node) != branchTargets.end()) {
+      return true;
+    }
+    std::vector<Node**> operands;
+    Node_Operands(node,operands);
+    for(size_t i = 0;i<operands.size();i++) {
+      if(Node_ContainsBranchTarget(*operands[i])) {
+	return true;
+      }
+    }
+    return false;
+  }
+  //Removes an instruction node. Branch targets are replaced with a NOP instead, so that jumps to them still land somewhere.
+  void Node_Discard(Node* inst) {
+    if(branchTargets.find(inst) == branchTargets.end()) {
+      Node_RemoveInstruction(inst);
+      return;
+    }
+    if(inst->type != NOPE) {
+      Node* nop = Node_Create<Node>(NOPE);
+      Node_Replace(inst,nop);
+      branchTargets.erase(inst);
+      branchTargets.insert(nop);
+    }
+  }
+  //Maps every node of an instruction's expression trees to the instruction which evaluates it
+  static void Node_MapOwners(Node* node, Node* owner, std::map<Node*,Node*>& output) {
+    output[node] = owner;
+    std::vector<Node**> operands;
+    Node_Operands(node,operands);
+    for(size_t i = 0;i<operands.size();i++) {
+      Node_MapOwners(*operands[i],owner,output);
+    }
+  }
+  //The node which is evaluated first when an instruction runs; the UAL offset of the instruction is the offset of this node
+  static Node* Node_FirstEvaluated(Node* node) {
+    while(true) {
+      Node* first = 0;
+      switch(node->type) {
+	case NStLoc:
+	  first = ((StLoc*)node)->exp;
+	  break;
+	case NRet:
+	  first = ((Ret*)node)->resultExpression;
+	  break;
+	case NBranch:
+	  //The Republican is pushed first
+	  first = ((Branch*)node)->right;
+	  break;
+	case NBinaryExpression:
+	  //NOT only has a Democrat
+	  first = ((BinaryExpression*)node)->right ? ((BinaryExpression*)node)->right : ((BinaryExpression*)node)->left;
+	  break;
+	case NCallNode:
+	  first = ((CallNode*)node)->arguments.size() ? ((CallNode*)node)->arguments[0] : 0;
+	  break;
+	default:
+	  break;
+      }
+      if(first == 0) {
+	return node;
+      }
+      node = first;
+    }
+  }
+  //Whether or not a node is part of a subtree
+  static bool Node_Contains(Node* tree, Node* node) {
+    if(tree == node) {
+      return true;
+    }
+    std::vector<Node**> operands;
+    Node_Operands(tree,operands);
+    for(size_t i = 0;i<operands.size();i++) {
+      if(Node_Contains(*operands[i],node)) {
+	return true;
+      }
+    }
+    return false;
+  }
+  //Inserts an instruction before another one. If the existing instruction is a branch target, jumps land on the new instruction instead.
+  Node* Node_InsertBefore(Node* inst, Node* newInst) {
+    newInst->prev = inst->prev;
+    newInst->next = inst;
+    if(inst->prev) {
+      inst->prev->next = newInst;
+    }
+    inst->prev = newInst;
+    if(inst == instructions) {
+      instructions = newInst;
+    }
+    if(branchTargets.erase(inst)) {
+      branchTargets.insert(newInst);
+      newInst->ualip = inst->ualip;
+      ualOffsets.Set(inst->ualip,newInst);
+    }
+    return newInst;
+  }
+  //Adds a compiler-generated local variable to the method
+  size_t NewLocal(TypeID type) {
+    locals.push_back(type);
+    return localVarCount++;
+  }
+  //Counts the nodes in a subtree
+  static size_t Node_Count(Node* node) {
+    size_t count = 1;
+    std::vector<Node**> operands;
+    Node_Operands(node,operands);
+    for(size_t i = 0;i<operands.size();i++) {
+      count+=Node_Count(*operands[i]);
+    }
+    return count;
+  }
+  //Whether or not a subtree contains a node of the specified type
+  static bool Node_Uses(Node* node, NodeType type) {
+    if(node->type == type) {
+      return true;
+    }
+    std::vector<Node**> operands;
+    Node_Operands(node,operands);
+    for(size_t i = 0;i<operands.size();i++) {
+      if(Node_Uses(*operands[i],type)) {
+	return true;
+      }
+    }
+    return false;
+  }
+  //Whether or not a node is a leaf which can be duplicated freely (a constant, or a load of a local or an argument)
+  static bool Node_IsTrivial(Node* node) {
+    switch(node->type) {
+      case NConstantInt:
+      case NConstantDouble:
+      case NConstantString:
+      case NLdLoc:
+      case NLdArg:
+	return true;
+      default:
+	return false;
+    }
+  }
+  //Copies a trivial node
+  Node* Node_CloneTrivial(Node* node) {
+    switch(node->type) {
+      case NConstantInt:
+	return Node_Create<ConstantInt>(((ConstantInt*)node)->value);
+      case NConstantDouble:
+	return Node_Create<ConstantDouble>(((ConstantDouble*)node)->value);
+      case NConstantString:
+	return Node_Create<ConstantString>(((ConstantString*)node)->value);
+      case NLdLoc:
+	return Node_Create<LdLoc>(((LdLoc*)node)->idx,node->resultType);
+      case NLdArg:
+	return Node_Create<LdArg>(((LdArg*)node)->index,node->resultType);
+      default:
+	throw "Node is not trivial";
+    }
+  }
+  //Inserts an instruction after another one (or at the start of the method if after is NULL). Branch targets are left untouched.
+  Node* Node_InsertAfter(Node* after, Node* newInst) {
+    newInst->prev = after;
+    newInst->next = after ? after->next : instructions;
+    if(newInst->next) {
+      newInst->next->prev = newInst;
+    }
+    if(after) {
+      after->next = newInst;
+    }else {
+      instructions = newInst;
+    }
+    if(after == lastInstruction) {
+      lastInstruction = newInst;
+    }
+    return newInst;
+  }
+  /**
+   * @summary Retrieves the instructions which may execute right after an instruction
+   * @param owners Maps every node to the instruction which evaluates it (see Node_MapOwners); branch targets may be nested in expressions
+   * */
+  void Node_Successors(Node* inst, std::map<Node*,Node*>& owners, std::vector<Node*>& output) {
+    if(inst->type == NRet) {
+      return;
+    }
+    if(inst->type == NBranch) {
+      Branch* b = (Branch*)inst;
+      Node* target = ualOffsets.Find(b->offset);
+      if(target && owners.find(target) != owners.end()) {
+	output.push_back(owners[target]);
+      }
+      if(b->condition == UnconditionalSurrender) {
+	return;
+      }
+    }
+    if(inst->next) {
+      output.push_back(inst->next);
+    }
+  }
   //END Optimization engine
   
-  UALMethod(const BStream& str, void* assembly, const char* sig) {
-    this->funcStart = JITCompiler->newLabel();
+  UALMethod(const BStream& str, void* assembly, MethodSignature* sig) {
     this->instructions = 0;
    // this->JITCompiler = new asmjit::X86Compiler(JITruntime);
     this->sig = sig;
     this->str = str;
+    this->definition = str;
     this->str.Read(isManaged);
-    arg_regs = new asmjit::X86GpVar[this->sig.args.size()];
+    localVarCount = 0;
+    arg_regs = 0;
+    stackOffsetTable = 0;
     if(isManaged) {
       this->str.Read(localVarCount);
       locals.resize(localVarCount);
       for(size_t i = 0;i<localVarCount;i++) {
-	locals[i] = this->str.ReadString();
+	locals[i] = InternType(this->str.ReadString());
       }
       
     }
+    declaredLocalCount = localVarCount;
     this->assembly = assembly;
+    inlinable = false;
     nativefunc = 0;
+    entry = 0;
+    cacheKey = 0;
+    cachedPool = 0;
+    cachedPoolCount = 0;
+    cachedConstaddr = 0;
+    codeSize = 0;
+    importTableOffset = 0;
+    constaddr = 0;
+    parsed = false;
+    prepared = false;
+    inBatch = false;
+    invocationCount = 0;
+    backedgeCount = 0;
+    isOSR = false;
+    osrOffset = 0;
+    profile = 0;
+    native = 0;
     constantStrings = 0;
     stringCount = 0;
     stringCapacity = 0;
@@ -698,61 +2002,983 @@ public:
   uint32_t ualip; //Instruction pointer into UAL
   void EnsureCapacity() {
     if(stringCount == stringCapacity) {
-      GC_String_Header** newList = new GC_String_Header*[stringCapacity*2];
+      size_t newCapacity = stringCapacity ? stringCapacity*2 : 1;
+      GC_String_Header** newList = new GC_String_Header*[newCapacity];
       for(size_t i = 0;i<stringCount;i++) {
 	newList[i] = constantStrings[i];
 	GC_Unmark((void**)(constantStrings+i),true);
 	GC_Mark((void**)(newList+i),true);
       }
-      delete[] constantStrings;
-      constantStrings = newList;
-      stringCapacity*=2;
+      delete[] constantStrings;
+      constantStrings = newList;
+      stringCapacity = newCapacity;
+    }
+  }
+  std::map<std::string,size_t> constantMappings;
+  std::vector<bool> bufferSlots; //Which entries of the constant pool are buffers rather than strings
+  
+  size_t GetString(const char* str) {
+    std::lock_guard<std::mutex> guard(constantPoolLock);
+    if(constantMappings.find(str) != constantMappings.end()) {
+      return constantMappings[str];
+    }
+    if(constantStrings == 0) {
+      constantStrings = new GC_String_Header*[1];
+      GC_String_Create(constantStrings[0],str);
+      GC_Mark((void**)constantStrings,true);
+      stringCapacity = 1;
+    }else {
+      EnsureCapacity();
+      GC_String_Create(constantStrings[stringCount],str);
+      GC_Mark((void**)constantStrings+stringCount,true);
+    }
+    constantMappings[str] = stringCount;
+    bufferSlots.push_back(false);
+    stringCount++;
+    constaddr = constantStrings;
+    return stringCount-1;
+  }
+  //Allocates a Buffer.
+  size_t AllocBuffer(void* bytes, size_t sz) {
+    std::lock_guard<std::mutex> guard(constantPoolLock);
+    EnsureCapacity();
+    GC_Array_Header* header;
+    GC_Array_Create_Primitive<unsigned char>(header,sz);
+    memcpy(header+1,bytes,sz);
+    constantStrings[stringCount] = (GC_String_Header*)header; //Whatever. We know it's not a string, but it's all just memory addresses anyways.
+    GC_Mark((void**)(constantStrings+stringCount),true);
+    bufferSlots.push_back(true);
+    stringCount++;
+    constaddr = constantStrings;
+    return stringCount-1;
+  }
+  
+  /**
+   * @summary Evaluates a System.Int32 binary operator at compile time. The interpreter runs on this too, and the JIT emits the same semantics
+   * (results wrap around at 32 bits, shift counts are masked to 5 bits), so folding never changes what a program computes.
+   * @param a The first operand pushed (the Republican)
+   * @param b The second operand pushed (the Democrat)
+   * @param result The result of a OP b
+   * @returns False if the operation must be left to run time (division by zero, or an overflowing division)
+   * */
+  static bool FoldInt(char op, int32_t a, int32_t b, int32_t& result) {
+    //Wrap around like the hardware does, without relying on signed overflow.
+    uint32_t ua = (uint32_t)a;
+    uint32_t ub = (uint32_t)b;
+    switch(op) {
+      case '+':
+	result = (int32_t)(ua+ub);
+	return true;
+      case '-':
+	result = (int32_t)(ua-ub);
+	return true;
+      case '*':
+	result = (int32_t)(ua*ub);
+	return true;
+      case '/':
+      case '%':
+	if(b == 0 || (a == INT32_MIN && b == -1)) {
+	  return false;
+	}
+	result = op == '/' ? a/b : a%b;
+	return true;
+      case '<':
+	result = (int32_t)(ua << (ub & 31));
+	return true;
+      case '>':
+	result = a >> (ub & 31);
+	return true;
+      case '&':
+	result = a & b;
+	return true;
+      case '|':
+	result = a | b;
+	return true;
+      case '~':
+	result = a ^ b;
+	return true;
+      default:
+	return false;
+    }
+  }
+  /**
+   * @summary Evaluates a branch condition at compile time
+   * @param right The first operand pushed
+   * @param left The second operand pushed
+   * */
+  template<typename T>
+  static bool FoldCondition(BranchCondition condition, T right, T left) {
+    switch(condition) {
+      case Ble:
+	return right <= left;
+      case Blt:
+	return right < left;
+      case Bgt:
+	return right > left;
+      case Bge:
+	return right >= left;
+      case Beq:
+	return right == left;
+      case Bne:
+	return right != left;
+      default:
+	return true;
+    }
+  }
+  /**
+   * @summary Folds constant subexpressions and applies algebraic identities to an expression tree
+   * @returns The expression to use in place of exp
+   * */
+  Node* FoldExpression(Node* exp) {
+    std::vector<Node**> operands;
+    Node_Operands(exp,operands);
+    for(size_t i = 0;i<operands.size();i++) {
+      *operands[i] = FoldExpression(*operands[i]);
+    }
+    if(exp->type != NBinaryExpression || Node_ContainsBranchTarget(exp)) {
+      return exp;
+    }
+    BinaryExpression* binexp = (BinaryExpression*)exp;
+    if(binexp->op == '!') {
+      //NOT only has a Democrat
+      if(binexp->left->type == NConstantInt) {
+	return Node_Create<ConstantInt>(~((ConstantInt*)binexp->left)->value);
+      }
+      return exp;
+    }
+    //The expression computes a OP b
+    Node* a = binexp->right;
+    Node* b = binexp->left;
+    if(binexp->resultType == TDouble) {
+      bool ca = a->type == NConstantDouble;
+      bool cb = b->type == NConstantDouble;
+      double va = ca ? ((ConstantDouble*)a)->value : 0;
+      double vb = cb ? ((ConstantDouble*)b)->value : 0;
+      if(ca && cb) {
+	switch(binexp->op) {
+	  case '+':
+	    return Node_Create<ConstantDouble>(va+vb);
+	  case '-':
+	    return Node_Create<ConstantDouble>(va-vb);
+	  case '*':
+	    return Node_Create<ConstantDouble>(va*vb);
+	  case '/':
+	    return Node_Create<ConstantDouble>(va/vb);
+	}
+	return exp;
+      }
+      //Only identities which hold for every IEEE value (including NaN and negative zero)
+      switch(binexp->op) {
+	case '-':
+	  if(cb && vb == 0 && !signbit(vb)) {
+	    return a;
+	  }
+	  break;
+	case '*':
+	  if(ca && va == 1) {
+	    return b;
+	  }
+	  if(cb && vb == 1) {
+	    return a;
+	  }
+	  break;
+	case '/':
+	  if(cb && vb == 1) {
+	    return a;
+	  }
+	  break;
+      }
+      return exp;
+    }
+    if(binexp->resultType != TInt32) {
+      return exp;
+    }
+    bool ca = a->type == NConstantInt;
+    bool cb = b->type == NConstantInt;
+    int32_t va = ca ? (int32_t)((ConstantInt*)a)->value : 0;
+    int32_t vb = cb ? (int32_t)((ConstantInt*)b)->value : 0;
+    if(ca && cb) {
+      int32_t result;
+      if(FoldInt(binexp->op,va,vb,result)) {
+	return Node_Create<ConstantInt>((uint32_t)result);
+      }
+      return exp;
+    }
+    switch(binexp->op) {
+      case '+':
+      case '|':
+      case '~':
+	if(ca && va == 0) {
+	  return b;
+	}
+	if(cb && vb == 0) {
+	  return a;
+	}
+	break;
+      case '-':
+	if(cb && vb == 0) {
+	  return a;
+	}
+	if(Node_IsPure(a) && Node_SameValue(a,b)) {
+	  return Node_Create<ConstantInt>(0);
+	}
+	break;
+      case '*':
+	if(ca && va == 1) {
+	  return b;
+	}
+	if(cb && vb == 1) {
+	  return a;
+	}
+	if((ca && va == 0 && Node_IsPure(b)) || (cb && vb == 0 && Node_IsPure(a))) {
+	  return Node_Create<ConstantInt>(0);
+	}
+	break;
+      case '&':
+	if((ca && va == 0 && Node_IsPure(b)) || (cb && vb == 0 && Node_IsPure(a))) {
+	  return Node_Create<ConstantInt>(0);
+	}
+	break;
+      case '/':
+	if(cb && vb == 1) {
+	  return a;
+	}
+	break;
+      case '%':
+	if(cb && vb == 1 && Node_IsPure(a)) {
+	  return Node_Create<ConstantInt>(0);
+	}
+	break;
+      case '<':
+      case '>':
+	if(cb && (vb & 31) == 0) {
+	  return a;
+	}
+	break;
+    }
+    return exp;
+  }
+  
+  //Folds constants in every instruction, and pre-evaluates constant branches
+  void FoldConstants() {
+    Node* next;
+    for(Node* inst = instructions;inst != 0;inst = next) {
+      next = inst->next;
+      std::vector<Node**> operands;
+      Node_Operands(inst,operands);
+      for(size_t i = 0;i<operands.size();i++) {
+	*operands[i] = FoldExpression(*operands[i]);
+      }
+      if(inst->type == NBranch) {
+	//Pre-evaluate comparisons between constants
+	Branch* b = (Branch*)inst;
+	if(b->condition == UnconditionalSurrender || b->left->type != b->right->type || Node_ContainsBranchTarget(b->left) || Node_ContainsBranchTarget(b->right)) {
+	  continue;
+	}
+	bool taken;
+	if(b->left->type == NConstantInt) {
+	  taken = FoldCondition(b->condition,(int32_t)((ConstantInt*)b->right)->value,(int32_t)((ConstantInt*)b->left)->value);
+	}else if(b->left->type == NConstantDouble) {
+	  taken = FoldCondition(b->condition,((ConstantDouble*)b->right)->value,((ConstantDouble*)b->left)->value);
+	}else {
+	  continue;
+	}
+	if(taken) {
+	  b->condition = UnconditionalSurrender;
+	  b->left = 0;
+	  b->right = 0;
+	}else {
+	  Node_Replace(b,Node_Create<Node>(NOPE));
+	}
+      }
+    }
+  }
+  //Removes instructions which cannot be reached from the start of the method
+  void RemoveUnreachableCode() {
+    std::map<Node*,Node*> owners;
+    for(Node* inst = instructions;inst != 0;inst = inst->next) {
+      Node_MapOwners(inst,inst,owners);
+    }
+    std::set<Node*> reachable;
+    std::vector<Node*> worklist;
+    if(instructions) {
+      worklist.push_back(instructions);
+    }
+    while(worklist.size()) {
+      Node* inst = worklist.back();
+      worklist.pop_back();
+      if(reachable.find(inst) != reachable.end()) {
+	continue;
+      }
+      reachable.insert(inst);
+      Node_Successors(inst,owners,worklist);
+    }
+    Node* next;
+    for(Node* inst = instructions;inst != 0;inst = next) {
+      next = inst->next;
+      if(reachable.find(inst) == reachable.end()) {
+	Node_RemoveInstruction(inst);
+      }
+    }
+  }
+  //Removes jumps to the next instruction, and NOPs which nothing jumps to
+  void RemoveRedundantInstructions() {
+    Node* next;
+    for(Node* inst = instructions;inst != 0;inst = next) {
+      next = inst->next;
+      if(inst->type == NBranch && ((Branch*)inst)->condition == UnconditionalSurrender) {
+	Node* target = ualOffsets.Find(((Branch*)inst)->offset);
+	if(target && target == inst->next) {
+	  Node_Discard(inst);
+	}
+      }else if(inst->type == NOPE) {
+	Node_Discard(inst);
+      }
+    }
+  }
+  //Internal -- Flags every local variable read by a subtree
+  static void MarkLocalReads(Node* node, std::vector<bool>& read) {
+    if(node->type == NLdLoc) {
+      read[((LdLoc*)node)->idx] = true;
+    }
+    std::vector<Node**> operands;
+    Node_Operands(node,operands);
+    for(size_t i = 0;i<operands.size();i++) {
+      MarkLocalReads(*operands[i],read);
+    }
+  }
+  //Removes stores to primitive locals which are never read anywhere in the method (repeats until nothing changes, since a removed store may hold the last read of another local)
+  void RemoveDeadStores() {
+    bool changed = true;
+    while(changed) {
+      changed = false;
+      std::vector<bool> read(localVarCount,false);
+      for(Node* inst = instructions;inst != 0;inst = inst->next) {
+	MarkLocalReads(inst,read);
+      }
+      Node* next;
+      for(Node* inst = instructions;inst != 0;inst = next) {
+	next = inst->next;
+	if(inst->type != NStLoc) {
+	  continue;
+	}
+	StLoc* op = (StLoc*)inst;
+	if(read[op->idx] || !IsPromotedLocal(op->idx) || Node_ContainsBranchTarget(op->exp)) {
+	  continue;
+	}
+	if(Node_IsPure(op->exp)) {
+	  Node_Discard(op);
+	  changed = true;
+	}else if(op->exp->type == NCallNode) {
+	  //Keep the call for its side effects, but drop its result
+	  uint32_t ip = op->exp->ualip;
+	  Node* call = Node_Replace(op,op->exp);
+	  call->ualip = ip;
+	  if(branchTargets.erase(op)) {
+	    branchTargets.insert(call);
+	  }
+	  changed = true;
+	}
+      }
+    }
+  }
+  
+  //Internal -- Replaces a subtree with an earlier identical expression if one is available, otherwise makes it (and its children) available
+  void ReuseExpression(Node** slot, Node* owner, std::vector<AvailableExpression>& available) {
+    Node* node = *slot;
+    if(node->type == NBinaryExpression && Node_IsPure(node)) {
+      for(size_t i = 0;i<available.size();i++) {
+	if(!Node_SameValue(available[i].node,node)) {
+	  continue;
+	}
+	if(available[i].temp == (size_t)-1) {
+	  //Compute the first occurrence into a new local right before the instruction which used it
+	  available[i].temp = NewLocal(node->resultType);
+	  StLoc* store = Node_Create<StLoc>(available[i].temp,available[i].node);
+	  *available[i].slot = Node_Create<LdLoc>(available[i].temp,node->resultType);
+	  Node_InsertBefore(available[i].owner,store);
+	  //The first occurrence (and everything inside of it) is now evaluated by the new store
+	  for(size_t c = 0;c<available.size();c++) {
+	    if(Node_Contains(store->exp,available[c].node)) {
+	      available[c].owner = store;
+	    }
+	  }
+	  available[i].slot = &store->exp;
+	}
+	*slot = Node_Create<LdLoc>(available[i].temp,node->resultType);
+	return;
+      }
+      AvailableExpression entry;
+      entry.node = node;
+      entry.slot = slot;
+      entry.owner = owner;
+      entry.reads.resize(localVarCount);
+      MarkLocalReads(node,entry.reads);
+      entry.temp = (size_t)-1;
+      available.push_back(entry);
+    }
+    std::vector<Node**> operands;
+    Node_Operands(node,operands);
+    for(size_t i = 0;i<operands.size();i++) {
+      ReuseExpression(operands[i],owner,available);
+    }
+  }
+  /**
+   * @summary Local value numbering. Within each basic block, a pure BinaryExpression which is identical to an earlier one
+   * (with no store to a local it reads in between) is replaced by a load of a compiler-generated local holding the earlier result.
+   * */
+  void EliminateCommonSubexpressions() {
+    std::vector<AvailableExpression> available;
+    for(Node* inst = instructions;inst != 0;inst = inst->next) {
+      if(branchTargets.find(inst) != branchTargets.end()) {
+	//Start of a basic block
+	available.clear();
+      }
+      std::vector<Node**> operands;
+      Node_Operands(inst,operands);
+      bool jumpedInto = false;
+      for(size_t i = 0;i<operands.size();i++) {
+	jumpedInto = jumpedInto || Node_ContainsBranchTarget(*operands[i]);
+      }
+      if(jumpedInto) {
+	//Code can jump into the middle of this instruction; leave it alone and start over after it
+	available.clear();
+	continue;
+      }
+      for(size_t i = 0;i<operands.size();i++) {
+	ReuseExpression(operands[i],inst,available);
+      }
+      if(inst->type == NStLoc) {
+	size_t idx = ((StLoc*)inst)->idx;
+	for(size_t i = 0;i<available.size();) {
+	  if(idx < available[i].reads.size() && available[i].reads[idx]) {
+	    available.erase(available.begin()+i);
+	  }else {
+	    i++;
+	  }
+	}
+      }
+      if(inst->type == NBranch) {
+	//End of a basic block
+	available.clear();
+      }
+    }
+  }
+  
+  bool inlinable; //Whether or not calls to this method may be replaced by a copy of its (optimized) parse tree
+  /**
+   * @summary Determines whether this method's body can be inlined: a small, side-effect free run of stores to locals, followed by a single Ret
+   * */
+  bool IsInlinable() {
+    if(!isManaged || lastInstruction == 0 || lastInstruction->type != NRet) {
+      return false;
+    }
+    size_t count = 0;
+    for(Node* inst = instructions;inst != 0;inst = inst->next) {
+      if(inst->type != NStLoc && inst->type != NOPE && inst != lastInstruction) {
+	return false;
+      }
+      if(!Node_IsPure(inst) || Node_Uses(inst,NConstantBuffer)) {
+	return false;
+      }
+      count+=Node_Count(inst);
+    }
+    return count <= INLINE_NODE_LIMIT;
+  }
+  //Internal -- Copies a node of an inlined method's body into this method
+  Node* CloneInlined(Node* node, const std::vector<Node*>& args, const std::vector<size_t>& localMap) {
+    switch(node->type) {
+      case NLdArg:
+	return Node_CloneTrivial(args[((LdArg*)node)->index]);
+      case NLdLoc:
+	return Node_Create<LdLoc>(localMap[((LdLoc*)node)->idx],node->resultType);
+      case NStLoc:
+	return Node_Create<StLoc>(localMap[((StLoc*)node)->idx],CloneInlined(((StLoc*)node)->exp,args,localMap));
+      case NBinaryExpression:
+      {
+	BinaryExpression* binexp = (BinaryExpression*)node;
+	Node* left = CloneInlined(binexp->left,args,localMap);
+	Node* right = binexp->right ? CloneInlined(binexp->right,args,localMap) : 0;
+	return Node_Create<BinaryExpression>(binexp->op,left,right);
+      }
+      default:
+	return Node_CloneTrivial(node);
+    }
+  }
+  /**
+   * @summary Replaces a call with a copy of the callee's body. Arguments which are not trivial are evaluated into new locals first,
+   * and the callee's statements are placed right before the calling instruction.
+   * @param slot The operand slot holding the call, or NULL if the call is an instruction of its own (its result is discarded)
+   * */
+  void InlineCall(Node** slot, CallNode* call, Node* inst) {
+    UALMethod* callee = call->method;
+    std::vector<Node*> args(call->arguments.size());
+    for(size_t i = 0;i<args.size();i++) {
+      Node* arg = call->arguments[i];
+      if(Node_IsTrivial(arg)) {
+	args[i] = arg;
+      }else {
+	size_t temp = NewLocal(arg->resultType);
+	Node_InsertBefore(inst,Node_Create<StLoc>(temp,arg));
+	args[i] = Node_Create<LdLoc>(temp,arg->resultType);
+      }
+    }
+    //Every local of the callee gets a fresh local here. Promoted locals are zeroed, just like on entry to the callee.
+    std::vector<size_t> localMap(callee->localVarCount);
+    for(size_t i = 0;i<localMap.size();i++) {
+      localMap[i] = NewLocal(callee->locals[i]);
+      if(callee->locals[i] == TInt32) {
+	Node_InsertBefore(inst,Node_Create<StLoc>(localMap[i],Node_Create<ConstantInt>(0)));
+      }else if(callee->locals[i] == TDouble) {
+	Node_InsertBefore(inst,Node_Create<StLoc>(localMap[i],Node_Create<ConstantDouble>(0.0)));
+      }
+    }
+    for(Node* cinst = callee->instructions;cinst != 0;cinst = cinst->next) {
+      if(cinst->type == NStLoc) {
+	Node_InsertBefore(inst,CloneInlined(cinst,args,localMap));
+      }else if(cinst->type == NRet && slot) {
+	*slot = CloneInlined(((Ret*)cinst)->resultExpression,args,localMap);
+      }
+    }
+    if(slot == 0) {
+      Node_Discard(call);
+    }
+  }
+  //Internal -- Inlines calls within a subtree (innermost first)
+  void InlineCalls(Node** slot, Node* inst, bool topLevel) {
+    Node* node = *slot;
+    std::vector<Node**> operands;
+    Node_Operands(node,operands);
+    for(size_t i = 0;i<operands.size();i++) {
+      InlineCalls(operands[i],inst,false);
+    }
+    if(node->type != NCallNode || !((CallNode*)node)->method->inlinable) {
+      return;
+    }
+    //Hoisting arguments with side effects ahead of the instruction is only safe if nothing else in the instruction is evaluated before the call.
+    if(!topLevel) {
+      bool pureArguments = true;
+      for(size_t i = 0;i<operands.size();i++) {
+	pureArguments = pureArguments && Node_IsPure(*operands[i]);
+      }
+      if(!pureArguments) {
+	return;
+      }
+    }
+    InlineCall(slot,(CallNode*)node,inst);
+  }
+  //Replaces calls to small managed methods with copies of their bodies
+  void InlineCalls() {
+    Node* next;
+    for(Node* inst = instructions;inst != 0;inst = next) {
+      next = inst->next;
+      std::vector<Node**> operands;
+      Node_Operands(inst,operands);
+      bool jumpedInto = false;
+      for(size_t i = 0;i<operands.size();i++) {
+	jumpedInto = jumpedInto || Node_ContainsBranchTarget(*operands[i]);
+      }
+      if(jumpedInto) {
+	continue;
+      }
+      bool topLevel = inst->type == NStLoc || inst->type == NRet;
+      for(size_t i = 0;i<operands.size();i++) {
+	InlineCalls(operands[i],inst,topLevel);
+      }
+      if(inst->type == NCallNode && ((CallNode*)inst)->method->inlinable) {
+	InlineCall(0,(CallNode*)inst,inst);
+      }
+    }
+  }
+  
+  std::vector<Loop> loops; //Natural loops of the method, outermost first (see FindLoops)
+  /**
+   * @summary Discovers the natural loops of the method. Dominators are computed over the instruction graph
+   * (Cooper, Harvey and Kennedy's iterative algorithm); every edge to a dominator is a back edge, and back edges to the same header form one loop.
+   * */
+  void FindLoops() {
+    loops.clear();
+    if(instructions == 0) {
+      return;
+    }
+    std::map<Node*,Node*> owners;
+    for(Node* inst = instructions;inst != 0;inst = inst->next) {
+      Node_MapOwners(inst,inst,owners);
+    }
+    //Number instructions in reverse postorder
+    std::map<Node*,size_t> order;
+    std::vector<Node*> postorder;
+    std::map<Node*,std::vector<Node*> > successors;
+    std::map<Node*,std::vector<Node*> > predecessors;
+    {
+      std::vector<std::pair<Node*,size_t> > worklist;
+      std::set<Node*> visited;
+      worklist.push_back(std::make_pair(instructions,(size_t)0));
+      visited.insert(instructions);
+      Node_Successors(instructions,owners,successors[instructions]);
+      while(worklist.size()) {
+	Node* inst = worklist.back().first;
+	size_t& edge = worklist.back().second;
+	if(edge < successors[inst].size()) {
+	  Node* succ = successors[inst][edge++];
+	  predecessors[succ].push_back(inst);
+	  if(visited.insert(succ).second) {
+	    Node_Successors(succ,owners,successors[succ]);
+	    worklist.push_back(std::make_pair(succ,(size_t)0));
+	  }
+	}else {
+	  postorder.push_back(inst);
+	  worklist.pop_back();
+	}
+      }
+    }
+    size_t count = postorder.size();
+    for(size_t i = 0;i<count;i++) {
+      order[postorder[i]] = count-i-1;
+    }
+    //Immediate dominators, indexed by reverse postorder number
+    std::vector<size_t> idom(count,(size_t)-1);
+    idom[0] = 0;
+    bool changed = true;
+    while(changed) {
+      changed = false;
+      for(size_t i = count-1;i-- > 0;) {
+	Node* inst = postorder[i];
+	std::vector<Node*>& preds = predecessors[inst];
+	size_t dom = (size_t)-1;
+	for(size_t p = 0;p<preds.size();p++) {
+	  size_t pred = order[preds[p]];
+	  if(idom[pred] == (size_t)-1) {
+	    continue;
+	  }
+	  if(dom == (size_t)-1) {
+	    dom = pred;
+	    continue;
+	  }
+	  //Intersect
+	  while(dom != pred) {
+	    while(dom > pred) {
+	      dom = idom[dom];
+	    }
+	    while(pred > dom) {
+	      pred = idom[pred];
+	    }
+	  }
+	}
+	size_t self = order[inst];
+	if(idom[self] != dom) {
+	  idom[self] = dom;
+	  changed = true;
+	}
+      }
+    }
+    //Back edges
+    std::map<Node*,size_t> loopIndex;
+    for(size_t i = 0;i<count;i++) {
+      Node* inst = postorder[i];
+      std::vector<Node*>& succs = successors[inst];
+      for(size_t s = 0;s<succs.size();s++) {
+	size_t header = order[succs[s]];
+	size_t dom = order[inst];
+	while(dom != header && dom != 0) {
+	  dom = idom[dom];
+	}
+	if(dom != header) {
+	  continue;
+	}
+	if(loopIndex.find(succs[s]) == loopIndex.end()) {
+	  loopIndex[succs[s]] = loops.size();
+	  Loop loop;
+	  loop.header = succs[s];
+	  loop.parent = 0;
+	  loop.depth = 1;
+	  loop.body.insert(succs[s]);
+	  loops.push_back(loop);
+	}
+	//Everything which reaches the back edge without passing through the header
+	Loop& loop = loops[loopIndex[succs[s]]];
+	std::vector<Node*> worklist;
+	worklist.push_back(inst);
+	while(worklist.size()) {
+	  Node* member = worklist.back();
+	  worklist.pop_back();
+	  if(loop.body.insert(member).second) {
+	    worklist.insert(worklist.end(),predecessors[member].begin(),predecessors[member].end());
+	  }
+	}
+      }
+    }
+    //Nesting; a loop's parent is the smallest other loop containing its header
+    std::vector<size_t> parents(loops.size(),(size_t)-1);
+    for(size_t i = 0;i<loops.size();i++) {
+      for(size_t c = 0;c<loops.size();c++) {
+	if(c == i || loops[c].body.size() <= loops[i].body.size() || loops[c].body.find(loops[i].header) == loops[c].body.end()) {
+	  continue;
+	}
+	if(parents[i] == (size_t)-1 || loops[c].body.size() < loops[parents[i]].body.size()) {
+	  parents[i] = c;
+	}
+      }
+    }
+    for(size_t i = 0;i<loops.size();i++) {
+      for(size_t c = parents[i];c != (size_t)-1;c = parents[c]) {
+	loops[i].depth++;
+      }
+    }
+    //Outermost first. Parent pointers are only taken once the vector is in its final order.
+    std::vector<Loop> sorted;
+    std::vector<size_t> position(loops.size());
+    for(size_t depth = 1;sorted.size()<loops.size();depth++) {
+      for(size_t i = 0;i<loops.size();i++) {
+	if(loops[i].depth == depth) {
+	  position[i] = sorted.size();
+	  sorted.push_back(loops[i]);
+	}
+      }
+    }
+    for(size_t i = 0;i<loops.size();i++) {
+      if(parents[i] != (size_t)-1) {
+	sorted[position[i]].parent = &sorted[position[parents[i]]];
+      }
+    }
+    loops.swap(sorted);
+  }
+  //Internal -- Whether or not an expression computes the same value on every iteration of a loop which stores to the specified locals
+  static bool IsLoopInvariant(Node* node, const std::vector<bool>& stored) {
+    switch(node->type) {
+      case NConstantInt:
+      case NConstantDouble:
+      case NLdArg:
+	return true;
+      case NLdLoc:
+	//Locals added by hoisting are only stored in front of the loop
+	return ((LdLoc*)node)->idx >= stored.size() || !stored[((LdLoc*)node)->idx];
+      case NBinaryExpression:
+      {
+	BinaryExpression* binexp = (BinaryExpression*)node;
+	return IsLoopInvariant(binexp->left,stored) && (binexp->right == 0 || IsLoopInvariant(binexp->right,stored));
+      }
+      default:
+	return false;
+    }
+  }
+  //Internal -- Moves the largest loop-invariant expressions within a subtree into the loop preheader
+  void HoistInvariants(Node** slot, const std::vector<bool>& stored, Node*& preheader, bool insertBefore) {
+    Node* node = *slot;
+    //Expressions which may trap must not be evaluated on paths where the loop body would not run
+    if(node->type == NBinaryExpression && IsLoopInvariant(node,stored) && Node_IsPure(node)) {
+      size_t temp = NewLocal(node->resultType);
+      StLoc* store = Node_Create<StLoc>(temp,node);
+      if(insertBefore) {
+	Node_InsertBefore(preheader,store);
+      }else {
+	preheader = Node_InsertAfter(preheader,store);
+      }
+      *slot = Node_Create<LdLoc>(temp,node->resultType);
+      return;
+    }
+    std::vector<Node**> operands;
+    Node_Operands(node,operands);
+    for(size_t i = 0;i<operands.size();i++) {
+      HoistInvariants(operands[i],stored,preheader,insertBefore);
+    }
+  }
+  /**
+   * @summary Loop-invariant code motion. Invariant, non-trapping BinaryExpressions are computed once into new locals in front of the loop.
+   * The preheader is the single edge into the loop header from outside the loop: either a fall-through, or an unconditional jump.
+   * Loops are visited outermost first, so an expression leaves as many loops as it is invariant in.
+   * */
+  void HoistLoopInvariants() {
+    FindLoops();
+    for(size_t l = 0;l<loops.size();l++) {
+      Loop& loop = loops[l];
+      //Hoisting may have moved branch targets onto new instructions
+      std::map<Node*,Node*> owners;
+      for(Node* inst = instructions;inst != 0;inst = inst->next) {
+	Node_MapOwners(inst,inst,owners);
+      }
+      //Find the edge into the loop
+      Node* entry = 0;
+      size_t entries = 0;
+      for(Node* inst = instructions;inst != 0;inst = inst->next) {
+	if(loop.body.find(inst) != loop.body.end()) {
+	  continue;
+	}
+	std::vector<Node*> succs;
+	Node_Successors(inst,owners,succs);
+	for(size_t s = 0;s<succs.size();s++) {
+	  if(succs[s] == loop.header) {
+	    entry = inst;
+	    entries++;
+	  }
+	}
+      }
+      //Whether the entry reaches the header by jumping (as opposed to falling through)
+      bool jumps = false;
+      if(entry && entry->type == NBranch) {
+	Node* target = ualOffsets.Find(((Branch*)entry)->offset);
+	jumps = target && owners[target] == loop.header;
+      }
+      Node* preheader;
+      bool insertBefore;
+      if(entries == 0 && loop.header == instructions) {
+	//The loop starts the method
+	preheader = 0;
+	insertBefore = false;
+      }else if(entries != 1) {
+	continue;
+      }else if(jumps && ((Branch*)entry)->condition == UnconditionalSurrender) {
+	//Compute invariants right before jumping into the loop
+	preheader = entry;
+	insertBefore = true;
+      }else if(entry->next == loop.header && !jumps) {
+	//Compute invariants between the fall-through and the header, where back edges do not go
+	preheader = entry;
+	insertBefore = false;
+      }else {
+	continue;
+      }
+      std::vector<bool> stored(localVarCount,false);
+      for(auto i = loop.body.begin();i != loop.body.end();i++) {
+	if((*i)->type == NStLoc) {
+	  stored[((StLoc*)*i)->idx] = true;
+	}
+      }
+      for(auto i = loop.body.begin();i != loop.body.end();i++) {
+	std::vector<Node**> operands;
+	Node_Operands(*i,operands);
+	bool jumpedInto = false;
+	for(size_t o = 0;o<operands.size();o++) {
+	  jumpedInto = jumpedInto || Node_ContainsBranchTarget(*operands[o]);
+	}
+	if(jumpedInto) {
+	  continue;
+	}
+	for(size_t o = 0;o<operands.size();o++) {
+	  HoistInvariants(operands[o],stored,preheader,insertBefore);
+	}
+      }
     }
   }
-  std::map<std::string,size_t> constantMappings;
-  
-  size_t GetString(const char* str) {
-    if(constantMappings.find(str) != constantMappings.end()) {
-      return constantMappings[str];
+  //Internal -- Whether or not a conditional branch can be flipped to its opposite condition without changing behaviour
+  static bool IsInvertible(Branch* b) {
+    if(b->condition == UnconditionalSurrender) {
+      return false;
     }
-    if(constantStrings == 0) {
-      constantStrings = new GC_String_Header*[1];
-      GC_String_Create(constantStrings[0],str);
-      GC_Mark((void**)constantStrings,true);
-      stringCapacity = 1;
-    }else {
-      EnsureCapacity();
-      GC_String_Create(constantStrings[stringCount],str);
-      GC_Mark((void**)constantStrings+stringCount,true);
+    //!(a < b) is not a >= b when either side is NaN, but == and != are exact opposites.
+    return b->left->resultType != TDouble || b->condition == Beq || b->condition == Bne;
+  }
+  /**
+   * @summary Retrieves the instruction a branch lands on. The offset of an instruction which takes operands maps to the node of its first operand,
+   * so this is the instruction which evaluates that node, provided the node is evaluated first (rather than in the middle of the instruction).
+   * @param owners Maps every node to the instruction which evaluates it (see Node_MapOwners)
+   * @returns The instruction, or NULL if the offset is unknown or does not start an instruction
+   * */
+  Node* BranchTarget(Branch* b, std::map<Node*,Node*>& owners) {
+    Node* target = ualOffsets.Find(b->offset);
+    if(target == 0) {
+      return 0;
     }
-    constantMappings[str] = stringCount;
-    stringCount++;
-    constaddr = constantStrings;
-    return stringCount-1;
+    std::map<Node*,Node*>::iterator owner = owners.find(target);
+    if(owner == owners.end() || Node_FirstEvaluated(owner->second) != target) {
+      return 0;
+    }
+    return owner->second;
   }
-  //Allocates a Buffer.
-  size_t AllocBuffer(void* bytes, size_t sz) {
-    EnsureCapacity();
-    GC_Array_Header* header;
-    GC_Array_Create_Primitive<unsigned char>(header,sz);
-    memcpy(header+1,bytes,sz);
-    constantStrings[stringCount] = (GC_String_Header*)header; //Whatever. We know it's not a string, but it's all just memory addresses anyways.
-    GC_Mark((void**)(constantStrings+stringCount),true);
-    stringCount++;
-    return stringCount-1;
+  /**
+   * @summary Arranges branches so that the common path falls through instead of jumping. There is no profile to go on, so this assumes
+   * loops keep looping and rewrites the two shapes which cost an extra taken jump:
+   * a conditional branch over a jump (if(c) goto A; goto B; A:) becomes a single inverted branch (if(!c) goto B; A:), and
+   * a loop tested at the top (H: if(c) goto X; body; goto H; X:) gets a copy of its test at the bottom (H: if(c) goto X; body; if(!c) goto body; X:),
+   * so that every iteration but the first takes a single branch.
+   * */
+  void LayoutBranches() {
+    std::map<Node*,Node*> owners;
+    for(Node* inst = instructions;inst != 0;inst = inst->next) {
+      Node_MapOwners(inst,inst,owners);
+    }
+    Node* next;
+    for(Node* inst = instructions;inst != 0;inst = next) {
+      next = inst->next;
+      if(inst->type != NBranch || next == 0 || next->type != NBranch || !IsInvertible((Branch*)inst)) {
+	continue;
+      }
+      Branch* b = (Branch*)inst;
+      Branch* jump = (Branch*)next;
+      if(jump->condition != UnconditionalSurrender || jump->next == 0 || branchTargets.find(jump) != branchTargets.end() || BranchTarget(b,owners) != jump->next || BranchTarget(jump,owners) == 0) {
+	continue;
+      }
+      b->condition = InvertCondition(b->condition);
+      b->offset = jump->offset;
+      next = jump->next;
+      Node_RemoveInstruction(jump);
+    }
+    FindBranchTargets();
+    for(Node* inst = instructions;inst != 0;inst = inst->next) {
+      if(inst->type != NBranch || ((Branch*)inst)->condition != UnconditionalSurrender) {
+	continue;
+      }
+      Branch* jump = (Branch*)inst;
+      Node* header = BranchTarget(jump,owners);
+      if(header == 0 || header->type != NBranch || !IsInvertible((Branch*)header)) {
+	continue;
+      }
+      Branch* test = (Branch*)header;
+      //Only leaves are copied, so that the copy of the test costs no more than the jump it replaces.
+      if(jump->next == 0 || BranchTarget(test,owners) != jump->next || !Node_IsTrivial(test->left) || !Node_IsTrivial(test->right)) {
+	continue;
+      }
+      Node* body = test->next;
+      if(body == 0) {
+	continue;
+      }
+      //The copy jumps to wherever the body starts, which has to be reachable by UAL offset
+      Node* bodyStart = Node_FirstEvaluated(body);
+      if(ualOffsets.Find(bodyStart->ualip) != bodyStart) {
+	continue;
+      }
+      jump->condition = InvertCondition(test->condition);
+      jump->left = Node_CloneTrivial(test->left);
+      jump->right = Node_CloneTrivial(test->right);
+      jump->offset = bodyStart->ualip;
+    }
   }
   
   void Optimize() {
+    FindBranchTargets();
+    InlineCalls();
+    FoldConstants();
+    RemoveUnreachableCode();
+    FindBranchTargets();
+    EliminateCommonSubexpressions();
+    if(!isOSR) {
+      //Entering at a loop header skips the preheader
+      HoistLoopInvariants();
+    }
+    RemoveDeadStores();
+    LayoutBranches();
+    FindBranchTargets();
+    RemoveRedundantInstructions();
+    inlinable = IsInlinable();
   }
   asmjit::X86Mem stackmem;
   size_t* stackOffsetTable;
+  std::vector<asmjit::X86GpVar> localGpRegs; //Virtual registers holding promoted System.Int32 locals
+  std::vector<asmjit::X86XmmVar> localXmmRegs; //Virtual registers holding promoted System.Double locals
+  /**
+   * @summary Determines whether a local variable lives in a virtual register for the whole method rather than in stackmem.
+   * UAL has no way to take the address of a local, so every primitive local qualifies. Managed references stay in memory so that GC_Mark can track them.
+   * */
+  bool IsPromotedLocal(size_t idx) {
+    return locals[idx] == TInt32 || locals[idx] == TDouble;
+  }
   size_t stackSize;
   //Internal -- Emits x86 code for a MARK instruction given a specified register containing a memory address to mark
   void EmitMark(asmjit::X86GpVar memreg, bool isRoot) {
     asmjit::FuncBuilderX builder;
     builder.addArg(asmjit::kVarTypeIntPtr);
     builder.addArg(asmjit::kVarTypeIntPtr);
-    asmjit::X86CallNode* call = JITCompiler->call((size_t)&GC_Mark,builder);
+    asmjit::X86CallNode* call = JITCompiler->call(ImportAddress(ImportRuntime,"GC_Mark",(void*)&GC_Mark),builder);
     call->setArg(0,memreg);
     call->setArg(1,asmjit::imm(isRoot));
   }
@@ -760,7 +2986,7 @@ public:
     asmjit::FuncBuilderX builder;
     builder.addArg(asmjit::kVarTypeIntPtr);
     builder.addArg(asmjit::kVarTypeIntPtr);
-    asmjit::X86CallNode* call = JITCompiler->call((size_t)&GC_Unmark,builder);
+    asmjit::X86CallNode* call = JITCompiler->call(ImportAddress(ImportRuntime,"GC_Unmark",(void*)&GC_Unmark),builder);
     call->setArg(0,memreg);
     call->setArg(1,asmjit::imm(isRoot));
   }
@@ -768,33 +2994,300 @@ public:
   asmjit::HLNode* currentNode;
   
   
-  //Internal -- Emits x86 code for a given tree node.
-  void EmitNode(Node* inst, asmjit::X86GpVar output) {
+  //Internal -- Binds the label of a tree node at the current position in the instruction stream.
+  void BindNode(Node* inst) {
+    if(!inst->referenced) {
+      return; //Nothing jumps here
+    }
     if(inst->bound) {
       abort();
     }
       JITCompiler->bind(inst->label);
       inst->bound = true;
+  }
+  
+  //Internal -- Emits SSE2 code for a tree node which produces a System.Double, leaving the result in an XMM register.
+  void EmitFloatNode(Node* inst, asmjit::X86XmmVar output) {
+    if(inst->type == NCallNode) {
+      //Calls return doubles in a general purpose register (see EmitNode); move the bits across.
+      asmjit::X86GpVar temp = JITCompiler->newIntPtr();
+      EmitNode(inst,temp);
+      JITCompiler->movq(output,temp);
+      return;
+    }
+    BindNode(inst);
+    switch(inst->type) {
+      case NConstantDouble:
+      {
+	ConstantDouble* cv = (ConstantDouble*)inst;
+	uint64_t val = *(uint64_t*)&cv->value;
+	if(val == 0) {
+	  //Positive zero; no need to touch memory or a general purpose register.
+	  JITCompiler->xorpd(output,output);
+	}else {
+	  asmjit::X86GpVar temp = JITCompiler->newIntPtr();
+	  JITCompiler->mov(temp,asmjit::imm(val));
+	  JITCompiler->movq(output,temp);
+	}
+      }
+	break;
+      case NLdLoc:
+      {
+	LdLoc* op = (LdLoc*)inst;
+	if(IsPromotedLocal(op->idx)) {
+	  JITCompiler->movapd(output,localXmmRegs[op->idx]);
+	  break;
+	}
+	asmjit::X86GpVar addr = JITCompiler->newIntPtr();
+	JITCompiler->lea(addr,stackmem);
+	JITCompiler->movsd(output,JITCompiler->intptr_ptr(addr,(int32_t)stackOffsetTable[op->idx]));
+      }
+	break;
+      case NLdArg:
+      {
+	//Arguments are passed in general purpose registers
+	LdArg* op = (LdArg*)inst;
+	JITCompiler->movq(output,arg_regs[op->index]);
+      }
+	break;
+      case NBinaryExpression:
+      {
+	BinaryExpression* binexp = (BinaryExpression*)inst;
+	asmjit::X86XmmVar r = JITCompiler->newXmmSd();
+	//NOTE: ORDER DOES MATTER! Republicans always have to be evaluated before Democrats!
+	EmitFloatNode(binexp->right,output);
+	EmitFloatNode(binexp->left,r);
+	switch(binexp->op) {
+	  case '+':
+	    JITCompiler->addsd(output,r);
+	    break;
+	  case '-':
+	    JITCompiler->subsd(output,r);
+	    break;
+	  case '*':
+	    JITCompiler->mulsd(output,r);
+	    break;
+	  case '/':
+	    JITCompiler->divsd(output,r);
+	    break;
+	  default:
+	    printf("Operator %c not implemented yet for System.Double....\n",binexp->op);
+	    abort();
+	}
+      }
+	break;
+      default:
+	printf("Unknown floating point tree instruction.\n");
+	abort();
+    }
+  }
+  
+  //Internal -- Emits a conditional branch on two System.Double operands.
+  void EmitFloatBranch(Branch* b, Node* bnode) {
+    asmjit::X86XmmVar left = JITCompiler->newXmmSd();
+    asmjit::X86XmmVar right = JITCompiler->newXmmSd();
+    EmitFloatNode(b->right,right);
+    EmitFloatNode(b->left,left);
+    //ucomisd sets the flags like an unsigned compare, and sets ZF, PF and CF when either operand is NaN.
+    //Operands are ordered so that every comparison involving NaN falls through (except !=).
+    switch(b->condition) {
+      case Ble:
+	JITCompiler->ucomisd(left,right);
+	JITCompiler->jae(bnode->label);
+	break;
+      case Blt:
+	JITCompiler->ucomisd(left,right);
+	JITCompiler->ja(bnode->label);
+	break;
+      case Bgt:
+	JITCompiler->ucomisd(right,left);
+	JITCompiler->ja(bnode->label);
+	break;
+      case Bge:
+	JITCompiler->ucomisd(right,left);
+	JITCompiler->jae(bnode->label);
+	break;
+      case Beq:
+      {
+	asmjit::Label unordered = JITCompiler->newLabel();
+	JITCompiler->ucomisd(right,left);
+	JITCompiler->jp(unordered);
+	JITCompiler->je(bnode->label);
+	JITCompiler->bind(unordered);
+      }
+	break;
+      case Bne:
+	JITCompiler->ucomisd(right,left);
+	JITCompiler->jp(bnode->label);
+	JITCompiler->jne(bnode->label);
+	break;
+      default:
+	printf("TODO: Implement branch\n");
+	abort();
+    }
+  }
+  
+  //Internal -- Emits the jump which follows a cmp(right,left) for a branch condition
+  void EmitConditionalJump(BranchCondition condition, const asmjit::Label& label) {
+    switch(condition) {
+      case Ble:
+	JITCompiler->jle(label);
+	break;
+      case Blt:
+	JITCompiler->jl(label);
+	break;
+      case Bgt:
+	JITCompiler->jg(label);
+	break;
+      case Bge:
+	JITCompiler->jge(label);
+	break;
+      case Beq:
+	JITCompiler->je(label);
+	break;
+      case Bne:
+	JITCompiler->jne(label);
+	break;
+      default:
+	printf("TODO: Implement branch\n");
+	abort();
+    }
+  }
+  
+  //Internal -- Emits a conditional branch on two System.Int32 (or managed reference) operands. A constant operand is compared as an immediate instead of being loaded into a register.
+  void EmitIntBranch(Branch* b, Node* bnode) {
+    if(b->left->type == NConstantInt) {
+      asmjit::X86GpVar right = JITCompiler->newIntPtr();
+      EmitNode(b->right,right);
+      BindNode(b->left);
+      JITCompiler->cmp(right,asmjit::imm((int32_t)((ConstantInt*)b->left)->value));
+      EmitConditionalJump(b->condition,bnode->label);
+      return;
+    }
+    if(b->right->type == NConstantInt) {
+      //cmp only takes an immediate on the right, so the operands trade places and the condition is mirrored.
+      asmjit::X86GpVar left = JITCompiler->newIntPtr();
+      BindNode(b->right);
+      EmitNode(b->left,left);
+      JITCompiler->cmp(left,asmjit::imm((int32_t)((ConstantInt*)b->right)->value));
+      EmitConditionalJump(MirrorCondition(b->condition),bnode->label);
+      return;
+    }
+    asmjit::X86GpVar left = JITCompiler->newIntPtr();
+    asmjit::X86GpVar right = JITCompiler->newIntPtr();
+    EmitNode(b->right,right);
+    EmitNode(b->left,left);
+    JITCompiler->cmp(right,left);
+    EmitConditionalJump(b->condition,bnode->label);
+  }
+  
+  //Internal -- Multiplies a System.Int32 in a register by a constant, using shifts and LEA where they beat imul, and wraps the product to 32 bits.
+  void EmitMultiplyByConstant(asmjit::X86GpVar output, int32_t value) {
+    int64_t magnitude = value < 0 ? -(int64_t)value : value;
+    if(magnitude == 0) {
+      JITCompiler->xor_(output,output);
+      return;
+    }
+    //Split the magnitude into (1, 3, 5 or 9) << shift
+    uint32_t shift = 0;
+    while((magnitude & 1) == 0) {
+      magnitude>>=1;
+      shift++;
+    }
+    if(magnitude == 3 || magnitude == 5 || magnitude == 9) {
+      uint32_t scale = magnitude == 3 ? 1 : magnitude == 5 ? 2 : 3;
+      JITCompiler->lea(output,asmjit::x86::ptr(output,output,scale));
+    }else if(magnitude != 1) {
+      JITCompiler->imul(output,output,asmjit::imm(value));
+      JITCompiler->movsxd(output,output.r32());
+      return;
+    }
+    if(shift) {
+      JITCompiler->shl(output,asmjit::imm(shift));
+    }
+    if(value < 0) {
+      JITCompiler->neg(output);
+    }
+    JITCompiler->movsxd(output,output.r32());
+  }
+  /**
+   * @summary Divides a System.Int32 in a register by a constant other than 0 and -1 without idiv (truncating, like idiv).
+   * System.Int32 values are always kept sign-extended in registers, so the magnitude of the dividend is at most 2^31, and with l = ceil(log2(|d|)) and m = floor(2^(32+l)/|d|)+1
+   * the product |x|*m fits in 64 bits and (|x|*m) >> (32+l) == |x|/|d| (Granlund and Montgomery).
+   * @param remainder Whether to compute the remainder rather than the quotient
+   * */
+  void EmitDivideByConstant(asmjit::X86GpVar output, int32_t divisor, bool remainder) {
+    uint64_t magnitude = divisor < 0 ? (uint64_t)(-(int64_t)divisor) : (uint64_t)divisor;
+    asmjit::X86GpVar dividend = JITCompiler->newIntPtr();
+    asmjit::X86GpVar sign = JITCompiler->newIntPtr();
+    JITCompiler->mov(dividend,output);
+    //output = |x|
+    JITCompiler->mov(sign,output);
+    JITCompiler->sar(sign,asmjit::imm(63));
+    JITCompiler->xor_(output,sign);
+    JITCompiler->sub(output,sign);
+    uint32_t l = 0;
+    while(((uint64_t)1 << l) < magnitude) {
+      l++;
+    }
+    if(((uint64_t)1 << l) == magnitude) {
+      if(l) {
+	JITCompiler->shr(output,asmjit::imm(l));
+      }
+    }else {
+      uint64_t m = (((uint64_t)1 << (32+l))/magnitude)+1;
+      asmjit::X86GpVar magic = JITCompiler->newIntPtr();
+      JITCompiler->mov(magic,asmjit::imm_u(m));
+      JITCompiler->imul(output,magic);
+      JITCompiler->shr(output,asmjit::imm(32+l));
+    }
+    //Give the quotient the sign of the dividend, then of the divisor
+    JITCompiler->xor_(output,sign);
+    JITCompiler->sub(output,sign);
+    if(divisor < 0) {
+      JITCompiler->neg(output);
+    }
+    if(remainder) {
+      //x - (x/d)*d
+      JITCompiler->imul(output,output,asmjit::imm(divisor));
+      JITCompiler->sub(dividend,output);
+      JITCompiler->mov(output,dividend);
+    }
+  }
+  
+  //Internal -- Emits x86 code for a given tree node.
+  void EmitNode(Node* inst, asmjit::X86GpVar output) {
+    if(inst->resultType == TDouble && inst->type != NCallNode) {
+      //Doubles are computed in XMM registers; only move the bits into a general purpose register at the end.
+      asmjit::X86XmmVar temp = JITCompiler->newXmmSd();
+      EmitFloatNode(inst,temp);
+      JITCompiler->movq(output,temp);
+      return;
+    }
+    BindNode(inst);
     
     
     switch(inst->type) {
 	case NStLoc:
 	{
 	  StLoc* op = (StLoc*)inst;
-	  if(op->exp->resultType == "System.Double") {
-	    //Optimize for double
-	    op->exp->fpEmit = true;
-	    EmitNode(op->exp,output);
-	    
-	    if(op->exp->fpEmit) {
-	      printf("BUG DETECTED: Subtree did not emit floating point values to stack (or fpEmit flag not cleared).\n");
-	      abort();
+	  if(IsPromotedLocal(op->idx)) {
+	    //Evaluate into a temporary first; the expression may read the old value of the local.
+	    if(op->exp->resultType == TDouble) {
+	      asmjit::X86XmmVar temp = JITCompiler->newXmmSd();
+	      EmitFloatNode(op->exp,temp);
+	      JITCompiler->movapd(localXmmRegs[op->idx],temp);
+	    }else {
+	      asmjit::X86GpVar temp = JITCompiler->newIntPtr();
+	      EmitNode(op->exp,temp);
+	      JITCompiler->mov(localGpRegs[op->idx],temp);
 	    }
+	  }else if(op->exp->resultType == TDouble) {
+	    asmjit::X86XmmVar temp = JITCompiler->newXmmSd();
+	    EmitFloatNode(op->exp,temp);
 	    asmjit::X86GpVar addr = JITCompiler->newIntPtr();
-	  JITCompiler->lea(addr,stackmem);
-	  
-	    //Write floating point to memory
-	    JITCompiler->fstp(JITCompiler->intptr_ptr(addr,(int32_t)stackOffsetTable[op->idx]));
+	    JITCompiler->lea(addr,stackmem);
+	    JITCompiler->movsd(JITCompiler->intptr_ptr(addr,(int32_t)stackOffsetTable[op->idx]),temp);
 	  }else {
 	  //Store result of expression into local variable
 	  asmjit::X86GpVar temp = JITCompiler->newIntPtr();
@@ -802,7 +3295,7 @@ public:
 	  asmjit::X86GpVar addr = JITCompiler->newIntPtr();
 	  JITCompiler->lea(addr,stackmem);
 	  JITCompiler->mov(JITCompiler->intptr_ptr(addr,(int32_t)stackOffsetTable[op->idx]),temp);
-	  if(!ResolveType(op->exp->resultType.data())->isStruct) {
+	  if(!ResolveType(op->exp->resultType)->isStruct) {
 	    JITCompiler->add(addr,(int32_t)stackOffsetTable[op->idx]);
 	    EmitMark(addr,true);
 	  }
@@ -814,60 +3307,63 @@ public:
 	    {
 	      //Load local variable
 	      LdLoc* op = (LdLoc*)inst;
+	      if(IsPromotedLocal(op->idx)) {
+		JITCompiler->mov(output,localGpRegs[op->idx]);
+		break;
+	      }
 	      asmjit::X86GpVar addr = JITCompiler->newIntPtr();
 	      JITCompiler->lea(addr,stackmem); //Load the effective base address of the stack
-	      if(op->fpEmit) {
-		//Store value into FPU
-		JITCompiler->fld(JITCompiler->intptr_ptr(addr,(int32_t)stackOffsetTable[op->idx]));
-		//Clear floating point flag
-		op->fpEmit = false;
-	      }else {
-		//Load the value from the base address into the output register
-		JITCompiler->mov(output,JITCompiler->intptr_ptr(addr,(int32_t)stackOffsetTable[op->idx])); 
-	      }
+	      //Load the value from the base address into the output register
+	      JITCompiler->mov(output,JITCompiler->intptr_ptr(addr,(int32_t)stackOffsetTable[op->idx])); 
 	    }
 	      break;
 	    case NLdArg:
 	    {
 	      LdArg* op = (LdArg*)inst;
-	      if(op->fpEmit) {
-		printf("TODO: Floating point arguments\n");
-		abort();
-	      }else {
-		//Load the value from the base address into the output register
-		JITCompiler->mov(output,arg_regs[op->index]); 
-	      }
+	      //Load the value from the base address into the output register
+	      JITCompiler->mov(output,arg_regs[op->index]); 
 	    }
 	      break;
 	case NConstantString:
 	{
-	  //Load constant string (we can now do this with only 2 instructions! Thanks to the constant pool.)
-	  asmjit::X86GpVar temp = JITCompiler->newIntPtr();
-	  //Load base address of constant pool
-	  JITCompiler->mov(temp,asmjit::imm((size_t)&constaddr));
-	  //Get memory address of constant pool (array)
-	  JITCompiler->mov(temp,JITCompiler->intptr_ptr(temp));
-	  
+	  //Load constant string (we can now do this with only 1 instruction! Thanks to the constant pool, whose address is loaded on entry.)
 	  //Return absolute memory address of string (by dereferencing the index in the array)
-	  JITCompiler->mov(output,JITCompiler->intptr_ptr(temp,sizeof(size_t)*GetString(((ConstantString*)inst)->value)));
+	  JITCompiler->mov(output,JITCompiler->intptr_ptr(constPool,sizeof(size_t)*GetString(((ConstantString*)inst)->value)));
 	  
 	}
 	  break;
+	case NConstantBuffer:
+	  //Buffers live in the constant pool too
+	  JITCompiler->mov(output,JITCompiler->intptr_ptr(constPool,sizeof(size_t)*((ConstantBuffer*)inst)->idx));
+	  break;
 	case NCallNode:
 	{
 	  //Function call
 	  CallNode* callme = (CallNode*)inst;
+	  if(IsSelfTailCall(callme) && callme->next && callme->next->type == NRet && ((Ret*)callme->next)->resultExpression == 0) {
+	    //Void self-recursive call followed by a return
+	    EmitSelfTailCall(callme);
+	    break;
+	  }
+	  UALMethod* method = callme->method;
+	  //Native functions take doubles in XMM registers; managed methods take everything in general purpose registers. Native callees have been resolved by Prepare.
+	  NativeFunction* ext = method->isManaged ? 0 : method->native;
 	  asmjit::FuncBuilderX builder;
 	  for(size_t i = 0;i<callme->arguments.size();i++) {
-	    builder.addArg(asmjit::kVarTypeIntPtr);
+	    builder.addArg(ext && ext->args[i] == NativeDouble ? asmjit::kVarTypeFp64 : asmjit::kVarTypeIntPtr);
 	  }
 	  
-	  UALMethod* method = callme->method;
-	  if(method->sig.returnType != "System.Void") {
-	    builder.setRet(asmjit::kVarTypeIntPtr);
+	  if(method->sig->returnType != TVoid) {
+	    builder.setRet(ext && ext->returnType == NativeDouble ? asmjit::kVarTypeFp64 : asmjit::kVarTypeIntPtr);
 	  }
-	  asmjit::X86GpVar* realargs = new asmjit::X86GpVar[method->sig.args.size()]; //varargs
-	  for(size_t i = 0;i<method->sig.args.size();i++) {
+	  ArenaArray<asmjit::X86GpVar> realargs(arena,method->sig->args.size()); //varargs
+	  ArenaArray<asmjit::X86XmmVar> floatargs(arena,method->sig->args.size());
+	  for(size_t i = 0;i<method->sig->args.size();i++) {
+	    if(ext && ext->args[i] == NativeDouble) {
+	      floatargs[i] = JITCompiler->newXmmSd();
+	      EmitFloatNode(callme->arguments[i],floatargs[i]);
+	      continue;
+	    }
 	    realargs[i] = JITCompiler->newIntPtr();
 	    EmitNode(callme->arguments[i],realargs[i]);
 	    
@@ -875,106 +3371,79 @@ public:
 	  
 	  asmjit::X86CallNode* call;
 	  if(callme->method->isManaged) {
-	   // printf("Managed method %s\n",method->sig.methodName.data());
-	    call = JITCompiler->call(method->funcStart,builder);
-	    if(callme->method->sig.returnType != "System.Void") {
+	   // printf("Managed method %s\n",method->sig->methodName.data());
+	    if(method == this) {
+	      //Recursion stays within the code of this method
+	      call = JITCompiler->call(funcStart,builder);
+	    }else {
+	      //Call through the entry of the callee: its stub until it has been compiled, then its native code.
+	      //Code calls no other method directly, so that the code of each method can be relocated (and cached) by itself.
+	      if(!method->inBatch && method->entry == 0 && std::find(stubQueue.begin(),stubQueue.end(),method) == stubQueue.end()) {
+		stubQueue.push_back(method);
+	      }
+	      asmjit::X86GpVar entryaddr = JITCompiler->newIntPtr();
+	      JITCompiler->mov(entryaddr,ImportAddress(ImportEntry,method->sig->fullSignature,&method->entry));
+	      call = JITCompiler->call(JITCompiler->intptr_ptr(entryaddr),builder);
+	    }
+	    if(callme->method->sig->returnType != TVoid) {
 	      call->setRet(0,output);
 	    }
 	  }else {
-	    call = JITCompiler->call((size_t)abi_ext[method->sig.methodName],builder);
+	    call = JITCompiler->call(ImportAddress(ImportNative,method->sig->methodName,ext->func),builder);
+	    switch(ext->returnType) {
+	      case NativeVoid:
+		break;
+	      case NativeDouble:
+	      {
+		//JIT code carries doubles around in general purpose registers (see EmitFloatNode)
+		asmjit::X86XmmVar result = JITCompiler->newXmmSd();
+		call->setRet(0,result);
+		JITCompiler->movq(output,result);
+	      }
+		break;
+	      case NativeInt:
+		call->setRet(0,output);
+		JITCompiler->movsxd(output,output.r32());
+		break;
+	      default:
+		call->setRet(0,output);
+	    }
 	  }
 	  //Bind arguments
 	  for(size_t i = 0;i<callme->arguments.size();i++) {
-	    call->setArg(i,realargs[i]);
+	    if(ext && ext->args[i] == NativeDouble) {
+	      call->setArg(i,floatargs[i]);
+	    }else {
+	      call->setArg(i,realargs[i]);
+	    }
 	  }
-	  delete[] realargs;
 	}
 	  break;
 	case NConstantInt:
 	{
 	  ConstantInt* ci = (ConstantInt*)inst;
-	  JITCompiler->mov(output,asmjit::imm(ci->value));
-	}
-	  break;
-	case NConstantDouble:
-	{
-	  ConstantDouble* cv = (ConstantDouble*)inst;
-	  //Load constant double
-	  uint64_t val = *(uint64_t*)&cv->value;
-	  if(cv->fpEmit) {
-	    cv->fpEmit = false;
-	    //NOTE: Assume instruction nodes stay constant in memory throughout program execution.
-	    asmjit::X86GpVar addr = JITCompiler->newIntPtr();
-	    JITCompiler->mov(addr,asmjit::imm((size_t)&cv->value));
-	    JITCompiler->fld(JITCompiler->intptr_ptr(addr));
-	    
-	  }else {
-	    JITCompiler->mov(output,asmjit::imm(val));
-	  }
+	  //Sign-extend, so that 64-bit arithmetic and comparisons agree with System.Int32 semantics
+	  JITCompiler->mov(output,asmjit::imm((int32_t)ci->value));
 	}
 	  break;
 	case NBinaryExpression:
 	{
+	  //Doubles never get here (see EmitFloatNode); use the ALU on the CPU.
 	  BinaryExpression* binexp = (BinaryExpression*)inst;
 	  switch(binexp->op) {
 	    case '+':
 	    {
-	      if(binexp->left->resultType == "System.Double") { //If we're a double, use the floating point unit instead of the processor.
-		binexp->left->fpEmit = true;
-		binexp->right->fpEmit = true;
-		
-		//NOTE: ORDER DOES MATTER! Republicans always have to be evaluated before Democrats!
-		EmitNode(binexp->right,output); //Evaluate Democratic candidates.
-		EmitNode(binexp->left,output); //Evaluate Republican candidates.
-		
-		if(binexp->left->fpEmit || binexp->right->fpEmit) {
-		  printf("BUG DETECTED: Subtree did not emit floating point values to stack (or fpEmit flag not cleared).\n");
-		  abort();
-		}
-		JITCompiler->faddp();
-		if(binexp->fpEmit) {
-		  binexp->fpEmit = false; //Let caller know that we've handled floating-point value.
-		}else {
-		  //Write value to output register
-		  asmjit::X86GpVar addr = JITCompiler->newIntPtr();
-		  JITCompiler->lea(addr,stackmem);
-		  JITCompiler->fstp(JITCompiler->intptr_ptr(addr,stackSize));
-		  JITCompiler->mov(output,JITCompiler->intptr_ptr(addr,stackSize));
-		}
-	      }else {
-		//Use the ALU on the CPU rather than the FPU.
 		asmjit::X86GpVar r = JITCompiler->newIntPtr();
 		
 		EmitNode(binexp->right,output);
 		EmitNode(binexp->left,r);
 		JITCompiler->add(output,r);
-	      }
+		//Wrap around to 32 bits, keeping System.Int32 values sign-extended
+		JITCompiler->movsxd(output,output.r32());
 	    }
 	      break;
 	      case '-':
 	    {
-	      if(binexp->left->resultType == "System.Double") { //If we're a double, use the floating point unit instead of the processor.
-		binexp->left->fpEmit = true;
-		binexp->right->fpEmit = true;
-		EmitNode(binexp->right,output); //Evaluate Democratic candidates.
-		EmitNode(binexp->left,output); //Evaluate Republican candidates.
-		
-		if(binexp->left->fpEmit || binexp->right->fpEmit) {
-		  printf("BUG DETECTED: Subtree did not emit floating point values to stack (or fpEmit flag not cleared).\n");
-		  abort();
-		}
-		JITCompiler->fsubp();
-		if(binexp->fpEmit) {
-		  binexp->fpEmit = false; //Let caller know that we've handled floating-point value.
-		}else {
-		  //Write value to output register
-		  asmjit::X86GpVar addr = JITCompiler->newIntPtr();
-		  JITCompiler->lea(addr,stackmem);
-		  JITCompiler->fstp(JITCompiler->intptr_ptr(addr,stackSize));
-		  JITCompiler->mov(output,JITCompiler->intptr_ptr(addr,stackSize));
-		}
-	      }else {
-		//Use the ALU on the CPU rather than the FPU.
 		asmjit::X86GpVar r = JITCompiler->newIntPtr();
 		
 		
@@ -983,86 +3452,119 @@ public:
 		EmitNode(binexp->left,r);
 		
 		JITCompiler->sub(output,r);
-	      }
+		JITCompiler->movsxd(output,output.r32());
 	    }
 	      break;
 	      case '*':
 	    {
-	      if(binexp->left->resultType == "System.Double") { //If we're a double, use the floating point unit instead of the processor.
-		binexp->left->fpEmit = true;
-		binexp->right->fpEmit = true;
-		EmitNode(binexp->right,output); //Evaluate Democratic candidates.
-		EmitNode(binexp->left,output); //Evaluate Republican candidates.
-		
-		if(binexp->left->fpEmit || binexp->right->fpEmit) {
-		  printf("BUG DETECTED: Subtree did not emit floating point values to stack (or fpEmit flag not cleared).\n");
-		  abort();
+		if(binexp->left->type == NConstantInt) {
+		  EmitNode(binexp->right,output);
+		  BindNode(binexp->left);
+		  EmitMultiplyByConstant(output,(int32_t)((ConstantInt*)binexp->left)->value);
+		  break;
 		}
-		JITCompiler->fmulp();
-		if(binexp->fpEmit) {
-		  binexp->fpEmit = false; //Let caller know that we've handled floating-point value.
-		}else {
-		  //Write value to output register
-		  asmjit::X86GpVar addr = JITCompiler->newIntPtr();
-		  JITCompiler->lea(addr,stackmem);
-		  JITCompiler->fstp(JITCompiler->intptr_ptr(addr,stackSize));
-		  JITCompiler->mov(output,JITCompiler->intptr_ptr(addr,stackSize));
+		if(binexp->right->type == NConstantInt) {
+		  BindNode(binexp->right);
+		  EmitNode(binexp->left,output);
+		  EmitMultiplyByConstant(output,(int32_t)((ConstantInt*)binexp->right)->value);
+		  break;
 		}
-	      }else {
-		//Use the ALU on the CPU rather than the FPU.
 		asmjit::X86GpVar r = JITCompiler->newIntPtr();
 		
 		EmitNode(binexp->right,output);
 		EmitNode(binexp->left,r);
 		JITCompiler->imul(output,r);
-	      }
+		JITCompiler->movsxd(output,output.r32());
 	    }
 	      break;
 	      case '/':
+	      case '%':
 	    {
-	      if(binexp->left->resultType == "System.Double") { //If we're a double, use the floating point unit instead of the processor.
-		binexp->left->fpEmit = true;
-		binexp->right->fpEmit = true;
-		EmitNode(binexp->right,output); //Evaluate Democratic candidates.
-		EmitNode(binexp->left,output); //Evaluate Republican candidates.
-		
-		if(binexp->left->fpEmit || binexp->right->fpEmit) {
-		  printf("BUG DETECTED: Subtree did not emit floating point values to stack (or fpEmit flag not cleared).\n");
-		  abort();
-		}
-		JITCompiler->fdivp();
-		if(binexp->fpEmit) {
-		  binexp->fpEmit = false; //Let caller know that we've handled floating-point value.
-		}else {
-		  //Write value to output register
-		  asmjit::X86GpVar addr = JITCompiler->newIntPtr();
-		  JITCompiler->lea(addr,stackmem);
-		  JITCompiler->fstp(JITCompiler->intptr_ptr(addr,stackSize));
-		  JITCompiler->mov(output,JITCompiler->intptr_ptr(addr,stackSize));
+		if(binexp->left->type == NConstantInt && (int32_t)((ConstantInt*)binexp->left)->value != 0 && (int32_t)((ConstantInt*)binexp->left)->value != -1) {
+		  EmitNode(binexp->right,output);
+		  BindNode(binexp->left);
+		  EmitDivideByConstant(output,(int32_t)((ConstantInt*)binexp->left)->value,binexp->op == '%');
+		  break;
 		}
-	      }else {
-		//Use the ALU on the CPU rather than the FPU.
 		asmjit::X86GpVar r = JITCompiler->newIntPtr();
 		
 		EmitNode(binexp->right,output);
 		EmitNode(binexp->left,r);
+		//Division by zero and INT32_MIN/-1 fail the same way as on the interpreter, rather than with SIGFPE
+		asmjit::Label fault = JITCompiler->newLabel();
+		asmjit::Label divide = JITCompiler->newLabel();
+		JITCompiler->test(r.r32(),r.r32());
+		JITCompiler->je(fault);
+		JITCompiler->cmp(r.r32(),asmjit::imm(-1));
+		JITCompiler->jne(divide);
+		JITCompiler->cmp(output.r32(),asmjit::imm(INT32_MIN));
+		JITCompiler->jne(divide);
+		JITCompiler->bind(fault);
+		{
+		  asmjit::FuncBuilderX builder;
+		  JITCompiler->call(ImportAddress(ImportRuntime,"Int32_DivideFault",(void*)&Int32_DivideFault),builder);
+		}
+		JITCompiler->bind(divide);
 		asmjit::X86GpVar reminder = JITCompiler->newIntPtr();
-		JITCompiler->xor_(reminder,reminder);
-		JITCompiler->idiv(reminder,output,r);
-	      }
+		JITCompiler->cdq(reminder.r32(),output.r32());
+		JITCompiler->idiv(reminder.r32(),output.r32(),r.r32());
+		if(binexp->op == '%') {
+		  JITCompiler->movsxd(output,reminder.r32());
+		}else {
+		  JITCompiler->movsxd(output,output.r32());
+		}
 	    }
 	      break;
-	      case '%':
+	      case '<':
+	      case '>':
+	    {
+		EmitNode(binexp->right,output);
+		if(binexp->left->type == NConstantInt) {
+		  BindNode(binexp->left);
+		  int32_t count = (int32_t)((ConstantInt*)binexp->left)->value & 31;
+		  if(binexp->op == '<') {
+		    JITCompiler->shl(output.r32(),asmjit::imm(count));
+		    JITCompiler->movsxd(output,output.r32());
+		  }else {
+		    JITCompiler->movsxd(output,output.r32());
+		    JITCompiler->sar(output,asmjit::imm(count));
+		  }
+		  break;
+		}
+		asmjit::X86GpVar count = JITCompiler->newIntPtr();
+		EmitNode(binexp->left,count);
+		//32-bit shifts mask the count to 5 bits, just like System.Int32
+		if(binexp->op == '<') {
+		  JITCompiler->shl(output.r32(),count.r8());
+		  JITCompiler->movsxd(output,output.r32());
+		}else {
+		  JITCompiler->sar(output.r32(),count.r8());
+		  JITCompiler->movsxd(output,output.r32());
+		}
+	    }
+	      break;
+	      case '&':
+	      case '|':
+	      case '~':
 	    {
-	     //Use the ALU on the CPU rather than the FPU.
 		asmjit::X86GpVar r = JITCompiler->newIntPtr();
 		
 		EmitNode(binexp->right,output);
 		EmitNode(binexp->left,r);
-		asmjit::X86GpVar reminder = JITCompiler->newIntPtr();
-		JITCompiler->xor_(reminder,reminder);
-		JITCompiler->idiv(reminder,output,r);
-		JITCompiler->mov(output,reminder);
+		if(binexp->op == '&') {
+		  JITCompiler->and_(output,r);
+		}else if(binexp->op == '|') {
+		  JITCompiler->or_(output,r);
+		}else {
+		  JITCompiler->xor_(output,r);
+		}
+	    }
+	      break;
+	      case '!':
+	    {
+		//NOT only has a Democrat
+		EmitNode(binexp->left,output);
+		JITCompiler->not_(output);
 	    }
 	      break;
 	    default:
@@ -1074,102 +3576,27 @@ public:
 	    case NBranch:
 	    {
 	      Branch* b = (Branch*)inst;
-	      if(ualOffsets.find(b->offset) == ualOffsets.end()) {
+	      Node* bnode = ualOffsets.Find(b->offset); //Node to branch to
+	      if(bnode == 0 || !bnode->referenced) {
 		throw "Illegal UAL offset";
 	      }
-	      Node* bnode = this->ualOffsets[b->offset]; //Node to branch to
-	      switch(b->condition) {
-		case UnconditionalSurrender:
-		{
-		  
-		  JITCompiler->jmp(bnode->label); //TODO: This jmp instruction seems to get rid of assembly instructions
-		  
-		}
-		  break;
-		case Ble:
-		{
-		  //Check conditions
-		  asmjit::X86GpVar left = JITCompiler->newIntPtr();
-		  asmjit::X86GpVar right = JITCompiler->newIntPtr();
-		  
-		 //ldconst.12 -- Load constant 12, this seems to be ommitted for some reason.
-		  EmitNode(b->right,right);
-		  EmitNode(b->left,left);
-		  JITCompiler->cmp(right,left);
-		  JITCompiler->jle(bnode->label);
-		}
-		  break;
-		  case Beq:
-		{
-		  //Check conditions
-		  asmjit::X86GpVar left = JITCompiler->newIntPtr();
-		  asmjit::X86GpVar right = JITCompiler->newIntPtr();
-		  
-		 //ldconst.12 -- Load constant 12, this seems to be ommitted for some reason.
-		  EmitNode(b->right,right);
-		  EmitNode(b->left,left);
-		  JITCompiler->cmp(right,left);
-		  JITCompiler->je(bnode->label);
-		}
-		  break;
-		  case Blt:
-		{
-		  //Check conditions
-		  asmjit::X86GpVar left = JITCompiler->newIntPtr();
-		  asmjit::X86GpVar right = JITCompiler->newIntPtr();
-		  
-		 //ldconst.12 -- Load constant 12, this seems to be ommitted for some reason.
-		  EmitNode(b->right,right);
-		  EmitNode(b->left,left);
-		  JITCompiler->cmp(right,left);
-		  JITCompiler->jl(bnode->label);
-		}
-		  break;
-		  case Bgt:
-		{
-		  //Check conditions
-		  asmjit::X86GpVar left = JITCompiler->newIntPtr();
-		  asmjit::X86GpVar right = JITCompiler->newIntPtr();
-		  
-		 //ldconst.12 -- Load constant 12, this seems to be ommitted for some reason.
-		  EmitNode(b->right,right);
-		  EmitNode(b->left,left);
-		  JITCompiler->cmp(right,left);
-		  JITCompiler->jg(bnode->label);
-		}
-		  break;
-		  case Bge:
-		{
-		  //Check conditions
-		  asmjit::X86GpVar left = JITCompiler->newIntPtr();
-		  asmjit::X86GpVar right = JITCompiler->newIntPtr();
-		  
-		 //ldconst.12 -- Load constant 12, this seems to be ommitted for some reason.
-		  EmitNode(b->right,right);
-		  EmitNode(b->left,left);
-		  JITCompiler->cmp(right,left);
-		  JITCompiler->jge(bnode->label);
-		}
-		  break;
-		  case Bne:
-		{
-		  //Check conditions
-		  asmjit::X86GpVar left = JITCompiler->newIntPtr();
-		  asmjit::X86GpVar right = JITCompiler->newIntPtr();
-		  
-		 //ldconst.12 -- Load constant 12, this seems to be ommitted for some reason.
-		  EmitNode(b->right,right);
-		  EmitNode(b->left,left);
-		  JITCompiler->cmp(right,left);
-		  JITCompiler->jne(bnode->label);
+	      if(b->condition == UnconditionalSurrender) {
+		JITCompiler->jmp(bnode->label);
+	      }else {
+#ifdef PROFILE
+		//inc leaves the flags of the compare below alone, since it comes first
+		size_t slot = profileSlots[b];
+		EmitCount(1+2*slot);
+#endif
+		if(b->left->resultType == TDouble) {
+		  EmitFloatBranch(b,bnode);
+		}else {
+		  EmitIntBranch(b,bnode);
 		}
-		  break;
-		  
-		default:
-		printf("TODO: Implement branch\n");
-		abort();
+#ifdef PROFILE
+		EmitCount(2+2*slot);
+#endif
 	      }
-	      
 	    }
 	      break;
 		case NOPE:
@@ -1178,7 +3605,10 @@ public:
 		case NRet:
 		{
 		  Ret* val = (Ret*)inst;
-		  if(val->resultExpression) {
+		  if(val->resultExpression && val->resultExpression->type == NCallNode && IsSelfTailCall((CallNode*)val->resultExpression)) {
+		    BindNode(val->resultExpression);
+		    EmitSelfTailCall((CallNode*)val->resultExpression);
+		  }else if(val->resultExpression) {
 		    
 		  asmjit::X86GpVar retreg = JITCompiler->newIntPtr();
 		    EmitNode(val->resultExpression,retreg);
@@ -1194,51 +3624,223 @@ public:
 	  abort();
       }
   }
+  //Whether or not a call is a recursive call to this method
+  bool IsSelfTailCall(CallNode* callme) {
+    return callme->method == this && isManaged;
+  }
+  //Internal -- Emits a self-recursive tail call as a jump back to the start of the method body, with the arguments replaced
+  void EmitSelfTailCall(CallNode* callme) {
+    //Evaluate every argument before overwriting any of them; the new values may depend on the old ones.
+    ArenaArray<asmjit::X86GpVar> temps(arena,callme->arguments.size());
+    for(size_t i = 0;i<temps.size();i++) {
+      temps[i] = JITCompiler->newIntPtr();
+      EmitNode(callme->arguments[i],temps[i]);
+    }
+    for(size_t i = 0;i<temps.size();i++) {
+      JITCompiler->mov(arg_regs[i],temps[i]);
+    }
+    JITCompiler->jmp(bodyStart);
+  }
+asmjit::X86GpVar constPool; //Address of the constant pool, loaded once on entry to the method
 asmjit::Label funcStart;
+asmjit::Label bodyStart; //Start of the method body, after the arguments have been received. Self-recursive tail calls jump here.
 asmjit::X86FuncNode* fnode;
+  std::vector<Import> imports; //Addresses the code of this method uses, in the order of its import table
+  asmjit::Label importTable;
+  asmjit::Label funcEnd; //End of the code of this method (after its import table)
+  //Internal -- Retrieves the entry of the import table which holds an address, adding it on first use
+  asmjit::X86Mem ImportAddress(ImportKind kind, const std::string& symbol, void* address) {
+    size_t i;
+    for(i = 0;i<imports.size();i++) {
+      if(imports[i].kind == kind && imports[i].symbol == symbol) {
+	break;
+      }
+    }
+    if(i == imports.size()) {
+      Import import;
+      import.kind = kind;
+      import.symbol = symbol;
+      import.address = address;
+      imports.push_back(import);
+    }
+    //RIP-relative, so the code works wherever it ends up
+    return asmjit::x86::ptr(importTable,(int32_t)(i*sizeof(uint64_t)));
+  }
+  uint64_t* profile; //Counters of the native code: calls, then executions and fall-throughs of each conditional branch (NULL unless profiled)
+  std::vector<uint32_t> profileBranches; //UAL offset of the branch behind each pair of counters
+  std::map<Node*,size_t> profileSlots; //Conditional branch -> its pair of counters
+  asmjit::X86GpVar profileBase;
+  //Internal -- Allocates the profile counters, once profileBranches is known
+  void AllocProfile() {
+    profile = new uint64_t[1+2*profileBranches.size()]();
+    std::lock_guard<std::mutex> guard(profileLock);
+    profiledMethods.push_back(this);
+  }
+  //Internal -- Emits an increment of a profile counter
+  void EmitCount(size_t counter) {
+    JITCompiler->inc(JITCompiler->intptr_ptr(profileBase,(int32_t)(counter*sizeof(uint64_t))));
+  }
   void Emit() {
     currentNode = 0;
+    imports.clear();
+    importTable = JITCompiler->newLabel();
+    funcEnd = JITCompiler->newLabel();
+    //Only the nodes branches land on get a label
+    FindBranchTargets();
+    for(auto i = branchTargets.begin();i != branchTargets.end();i++) {
+      (*i)->label = JITCompiler->newLabel();
+      (*i)->referenced = true;
+      (*i)->bound = false;
+    }
     asmjit::FuncBuilderX builder;
-    if(sig.returnType != "System.Void") {
+    if(sig->returnType != TVoid) {
       builder.setRet(asmjit::kVarTypeIntPtr);
     }
-    for(size_t i = 0;i<this->sig.args.size();i++) {
+    if(isOSR) {
+      //Takes the arguments and the locals of the interpreted activation instead (see OSREntry)
+      builder.addArg(asmjit::kVarTypeIntPtr);
+      builder.addArg(asmjit::kVarTypeIntPtr);
+    }else {
+    for(size_t i = 0;i<this->sig->args.size();i++) {
       builder.addArg(asmjit::kVarTypeIntPtr);
     }
+    }
     JITCompiler->bind(funcStart);
     fnode = JITCompiler->addFunc(builder);
-    for(size_t i = 0;i<sig.args.size();i++) {
+    arg_regs = arena.AllocateArray<asmjit::X86GpVar>(sig->args.size());
+    asmjit::X86GpVar osrArgs;
+    asmjit::X86GpVar osrLocals;
+    if(isOSR) {
+      osrArgs = JITCompiler->newIntPtr("osrargs");
+      osrLocals = JITCompiler->newIntPtr("osrlocals");
+      JITCompiler->setArg(0,osrArgs);
+      JITCompiler->setArg(1,osrLocals);
+    }
+    for(size_t i = 0;i<sig->args.size();i++) {
       char mander[256];
       memset(mander,0,256);
       sprintf(mander,"arg%i",(int)i);
       arg_regs[i] = JITCompiler->newIntPtr(mander);
+      if(isOSR) {
+	JITCompiler->mov(arg_regs[i],JITCompiler->intptr_ptr(osrArgs,(int32_t)(i*sizeof(uint64_t))));
+      }else {
       JITCompiler->setArg(i,arg_regs[i]); //TODO: Something here with args causes assertion failure about register ID.
+      }
     }
+#ifdef PROFILE
+    {
+      profileBranches.clear();
+      profileSlots.clear();
+      std::string symbol;
+      for(Node* inst = instructions;inst != 0;inst = inst->next) {
+	if(inst->type == NBranch && ((Branch*)inst)->condition != UnconditionalSurrender) {
+	  profileSlots[inst] = profileBranches.size();
+	  profileBranches.push_back(inst->ualip);
+	  char mander[16];
+	  sprintf(mander,symbol.empty() ? "%u" : ",%u",(unsigned int)inst->ualip);
+	  symbol+=mander;
+	}
+      }
+      AllocProfile();
+      profileBase = JITCompiler->newIntPtr("profile");
+      JITCompiler->mov(profileBase,ImportAddress(ImportProfile,symbol,profile));
+      //Self tail calls jump to bodyStart, so they do not count as calls
+      EmitCount(0);
+    }
+#endif
+    bodyStart = JITCompiler->newLabel();
+    JITCompiler->bind(bodyStart);
     //BEGIN set up stack
     
-    stackOffsetTable = new size_t[localVarCount];
+    stackOffsetTable = arena.AllocateArray<size_t>(localVarCount);
     stackSize = 0;
     {
       size_t cOffset = 0;
       for(size_t i = 0;i<localVarCount;i++) {
-	Type* tdef = ResolveType(this->locals[i].data());
+	if(IsPromotedLocal(i)) {
+	  //Lives in a register (see BEGIN VARIABLES)
+	  stackOffsetTable[i] = 0;
+	  continue;
+	}
+	Type* tdef = ResolveType(this->locals[i]);
 	size_t requiredSize = 0;
 	if(tdef->isStruct) {
 	  requiredSize = tdef->size;
 	}else {
 	  requiredSize = sizeof(size_t);
 	}
-	requiredSize+=(requiredSize % 8); //Align stack to largest size possible primitive datatype.
+	//Every slot is a whole number of 64-bit words: locals are loaded and stored (and taken over from the interpreter) 8 bytes at a time.
+	requiredSize = (requiredSize+7) & ~(size_t)7;
 	
 	stackSize+=requiredSize;
 	stackOffsetTable[i] = cOffset;
 	cOffset+=requiredSize;
       }
     }
-    stackmem = JITCompiler->newStack(stackSize+(sizeof(double)*2),8);
+    stackmem = JITCompiler->newStack(stackSize ? stackSize : sizeof(double),8);
     //END set up stack
     //BEGIN VARIABLES
-    
+    //Promoted locals get a virtual register each; the register allocator spills them only under pressure.
+    //They start out zeroed so that every path into the method defines them.
+    localGpRegs.resize(localVarCount);
+    localXmmRegs.resize(localVarCount);
+    for(size_t i = 0;i<localVarCount;i++) {
+      if(!IsPromotedLocal(i)) {
+	continue;
+      }
+      char mander[256];
+      memset(mander,0,256);
+      sprintf(mander,"loc%i",(int)i);
+      if(locals[i] == TDouble) {
+	localXmmRegs[i] = JITCompiler->newXmmSd(mander);
+	JITCompiler->xorpd(localXmmRegs[i],localXmmRegs[i]);
+      }else {
+	localGpRegs[i] = JITCompiler->newIntPtr(mander);
+	JITCompiler->xor_(localGpRegs[i],localGpRegs[i]);
+      }
+    }
+    //The constant pool only moves while this method is being JITted, so its address can be loaded once per call rather than in every loop iteration.
+    for(Node* inst = instructions;inst != 0;inst = inst->next) {
+      if(Node_Uses(inst,NConstantString) || Node_Uses(inst,NConstantBuffer)) {
+	constPool = JITCompiler->newIntPtr("constpool");
+	JITCompiler->mov(constPool,ImportAddress(ImportConstantPool,"",&constaddr));
+	JITCompiler->mov(constPool,JITCompiler->intptr_ptr(constPool));
+	break;
+      }
+    }
+    if(isOSR) {
+      //Take over the locals of the interpreted activation (each is 64 bits wide there, just like a stack slot here), then carry on at the loop header it was about to run
+      for(size_t i = 0;i<localVarCount;i++) {
+	if(i >= declaredLocalCount) {
+	  //A temporary of the optimizer, which the interpreter knows nothing about; promoted ones are zeroed above already
+	  if(!IsPromotedLocal(i)) {
+	    asmjit::X86GpVar addr = JITCompiler->newIntPtr();
+	    JITCompiler->lea(addr,stackmem);
+	    JITCompiler->mov(JITCompiler->intptr_ptr(addr,(int32_t)stackOffsetTable[i]),asmjit::imm(0));
+	  }
+	  continue;
+	}
+	asmjit::X86Mem slot = JITCompiler->intptr_ptr(osrLocals,(int32_t)(i*sizeof(uint64_t)));
+	if(IsPromotedLocal(i)) {
+	  if(locals[i] == TDouble) {
+	    JITCompiler->movsd(localXmmRegs[i],slot);
+	  }else {
+	    JITCompiler->mov(localGpRegs[i],slot);
+	  }
+	  continue;
+	}
+	asmjit::X86GpVar temp = JITCompiler->newIntPtr();
+	JITCompiler->mov(temp,slot);
+	asmjit::X86GpVar addr = JITCompiler->newIntPtr();
+	JITCompiler->lea(addr,stackmem);
+	JITCompiler->mov(JITCompiler->intptr_ptr(addr,(int32_t)stackOffsetTable[i]),temp);
+	if(!ResolveType(locals[i])->isStruct) {
+	  JITCompiler->add(addr,(int32_t)stackOffsetTable[i]);
+	  EmitMark(addr,true);
+	}
+      }
+      JITCompiler->jmp(ualOffsets.Find(osrOffset)->label);
+    }
     //END VARIABLES
     
     
@@ -1251,12 +3853,626 @@ asmjit::X86FuncNode* fnode;
     }
     //END Code emit
     JITCompiler->endFunc();
-    
+    JITCompiler->align(asmjit::kAlignData,sizeof(uint64_t));
+    JITCompiler->bind(importTable);
+    for(size_t i = 0;i<imports.size();i++) {
+      uint64_t address = (uint64_t)imports[i].address;
+      JITCompiler->embed(&address,sizeof(address));
+    }
+    JITCompiler->bind(funcEnd);
   }
-  void Compile() {
-    Parse();
+  //Internal -- Finds the calls made by an expression tree
+  static void Node_FindCalls(Node* node, std::vector<CallNode*>& output) {
+    if(node->type == NCallNode) {
+      output.push_back((CallNode*)node);
+    }
+    std::vector<Node**> operands;
+    Node_Operands(node,operands);
+    for(size_t i = 0;i<operands.size();i++) {
+      Node_FindCalls(*operands[i],output);
+    }
+  }
+  uint64_t cacheKey; //Identifies the code of this method in the code cache
+  GC_String_Header** cachedPool; //Constant pool of code loaded from the code cache
+  size_t cachedPoolCount;
+  void* cachedConstaddr; //Address of cachedPool, where the cached code looks for it
+  //Internal -- Finds the methods called by the bytecode of this method, without parsing it
+  void ScanCalls(std::vector<UALMethod*>& output) {
+    BStream reader = str;
+    unsigned char opcode;
+    uint32_t operand;
+    while(reader.len && reader.Read(opcode) != 255) {
+      switch(opcode) {
+	case 1:
+	{
+	  reader.Read(operand);
+	  UALMethod* method = ResolveMethod(assembly,operand);
+	  if(method) {
+	    output.push_back(method);
+	  }
+	}
+	  break;
+	case 2:
+	  reader.ReadString();
+	  break;
+	case 0:
+	case 4:
+	case 5:
+	case 6:
+	case 7:
+	case 9:
+	case 11:
+	case 12:
+	case 13:
+	case 14:
+	  reader.Read(operand);
+	  break;
+	case 25:
+	  reader.Increment(sizeof(double));
+	  break;
+	case 26:
+	  reader.Read(operand);
+	  reader.Increment(operand);
+	  break;
+	case 3:
+	case 8:
+	case 10:
+	  break;
+	default:
+	  if(opcode < 15 || opcode > 24) {
+	    return;
+	  }
+      }
+    }
+  }
+#ifdef CODE_CACHE_DIR
+  /**
+   * @summary Adds everything the code of this method depends on to a hash: its bytecode, and each method it calls, as the call is made
+   * (the signature, whether it is managed, and for native methods the C signature arguments are marshalled by).
+   * Small managed callees may get inlined, so their bytecode counts as well.
+   * */
+  uint64_t HashCode(uint64_t hash, std::set<UALMethod*>& visited) {
+    if(visited.find(this) != visited.end()) {
+      return hash;
+    }
+    visited.insert(this);
+    hash = Hash_Add(hash,sig->fullSignature.data(),sig->fullSignature.size()+1);
+    for(size_t i = 0;i<localVarCount;i++) {
+      const char* name = TypeName(locals[i]);
+      hash = Hash_Add(hash,name,strlen(name)+1);
+    }
+    hash = Hash_Add(hash,str.ptr,str.len);
+    std::vector<UALMethod*> callees;
+    ScanCalls(callees);
+    for(size_t i = 0;i<callees.size();i++) {
+      UALMethod* callee = callees[i];
+      hash = Hash_Add(hash,callee->sig->fullSignature.data(),callee->sig->fullSignature.size()+1);
+      hash = Hash_Add(hash,&callee->isManaged,sizeof(callee->isManaged));
+      if(!callee->isManaged) {
+	auto ext = abi_ext.find(callee->sig->methodName);
+	uint32_t types = ext == abi_ext.end() ? NativeVoid : 1+ext->second.returnType;
+	hash = Hash_Add(hash,&types,sizeof(types));
+	for(size_t a = 0;ext != abi_ext.end() && a<ext->second.args.size();a++) {
+	  types = ext->second.args[a];
+	  hash = Hash_Add(hash,&types,sizeof(types));
+	}
+      }else if(callee->str.len <= INLINE_BYTECODE_LIMIT) {
+	hash = callee->HashCode(hash,visited);
+      }
+    }
+    return hash;
+  }
+  std::string CachePath() {
+    char mander[64];
+    sprintf(mander,"/%016llx.bin",(unsigned long long)cacheKey);
+    return Cache_Directory()+mander;
+  }
+#endif
+  size_t codeSize; //Size of the native code of this method, including its import table
+  size_t importTableOffset; //Where the import table starts in the native code
+  /**
+   * @summary Serializes what it takes to link the native code of this method somewhere else: its imports and its constant pool
+   * */
+  void SaveImports(std::vector<unsigned char>& out) {
+    uint32_t word = (uint32_t)importTableOffset;
+    Buffer_Append(out,word);
+    word = (uint32_t)imports.size();
+    Buffer_Append(out,word);
+    for(size_t i = 0;i<imports.size();i++) {
+      unsigned char kind = (unsigned char)imports[i].kind;
+      Buffer_Append(out,kind);
+      Buffer_Append(out,imports[i].symbol.data(),imports[i].symbol.size()+1);
+    }
+    std::lock_guard<std::mutex> guard(constantPoolLock);
+    word = (uint32_t)stringCount;
+    Buffer_Append(out,word);
+    for(size_t i = 0;i<stringCount;i++) {
+      unsigned char isBuffer = bufferSlots[i];
+      Buffer_Append(out,isBuffer);
+      if(isBuffer) {
+	GC_Array_Header* header = (GC_Array_Header*)constantStrings[i];
+	word = (uint32_t)(header->count*header->stride);
+	Buffer_Append(out,word);
+	Buffer_Append(out,header+1,word);
+      }else {
+	word = constantStrings[i]->length;
+	Buffer_Append(out,word);
+	Buffer_Append(out,GC_String_Cstr(constantStrings[i]),word);
+      }
+    }
+  }
+  /**
+   * @summary Links native code of this method which was compiled by another process, from what SaveImports wrote
+   * @param code The native code
+   * @param relocate True to copy the code to executable memory before patching it, false to patch it where it is
+   * @returns False if an import can no longer be resolved
+   * */
+  bool LinkImports(BStream& reader, unsigned char* code, size_t size, bool relocate) {
+    uint32_t tableOffset;
+    uint32_t importCount;
+    reader.Read(tableOffset);
+    reader.Read(importCount);
+    if(tableOffset+(size_t)importCount*sizeof(uint64_t) > size) {
+      return false;
+    }
+    std::vector<void*> addresses(importCount);
+    std::vector<UALMethod*> callees;
+    std::vector<uint32_t> branches;
+    size_t profileImport = importCount;
+    for(size_t i = 0;i<importCount;i++) {
+      unsigned char kind;
+      reader.Read(kind);
+      std::string symbol = reader.ReadString();
+      switch(kind) {
+	case ImportConstantPool:
+	  addresses[i] = &cachedConstaddr;
+	  break;
+	case ImportNative:
+	{
+	  auto ext = abi_ext.find(symbol);
+	  if(ext == abi_ext.end()) {
+	    return false;
+	  }
+	  addresses[i] = ext->second.func;
+	}
+	  break;
+	case ImportEntry:
+	{
+	  UALMethod* callee = FindMethod(symbol);
+	  if(callee == 0) {
+	    return false;
+	  }
+	  addresses[i] = &callee->entry;
+	  callees.push_back(callee);
+	}
+	  break;
+	case ImportRuntime:
+	  addresses[i] = Runtime_Symbol(symbol);
+	  if(addresses[i] == 0) {
+	    return false;
+	  }
+	  break;
+	case ImportProfile:
+	{
+	  //Allocated below, once nothing can fail any more
+	  profileImport = i;
+	  const char* ptr = symbol.data();
+	  while(*ptr) {
+	    char* end;
+	    branches.push_back((uint32_t)strtoul(ptr,&end,10));
+	    if(end == ptr) {
+	      return false;
+	    }
+	    ptr = *end == ',' ? end+1 : end;
+	  }
+	}
+	  break;
+	default:
+	  return false;
+      }
+    }
+    uint32_t poolCount;
+    reader.Read(poolCount);
+    std::vector<bool> isBuffer(poolCount);
+    std::vector<std::string> poolData(poolCount);
+    for(size_t i = 0;i<poolCount;i++) {
+      unsigned char flag;
+      uint32_t sz;
+      reader.Read(flag);
+      reader.Read(sz);
+      isBuffer[i] = flag;
+      poolData[i].assign((const char*)reader.Increment(sz),sz);
+    }
+    //Everything checks out; nothing below can fail.
+    cachedPool = new GC_String_Header*[poolCount ? poolCount : 1];
+    cachedPoolCount = poolCount;
+    for(size_t i = 0;i<poolCount;i++) {
+      if(isBuffer[i]) {
+	GC_Array_Header* header;
+	GC_Array_Create_Primitive<unsigned char>(header,poolData[i].size());
+	memcpy(header+1,poolData[i].data(),poolData[i].size());
+	cachedPool[i] = (GC_String_Header*)header;
+      }else {
+	GC_String_Create(cachedPool[i],poolData[i].data());
+      }
+      GC_Mark((void**)(cachedPool+i),true);
+    }
+    cachedConstaddr = cachedPool;
+    if(profileImport != importCount) {
+      profileBranches = branches;
+      AllocProfile();
+      addresses[profileImport] = profile;
+    }
+    unsigned char* native = code;
+    if(relocate) {
+      native = (unsigned char*)Cache_AllocCode(size);
+      memcpy(native,code,size);
+    }
+    for(size_t i = 0;i<importCount;i++) {
+      uint64_t address = (uint64_t)addresses[i];
+      memcpy(native+tableOffset+i*sizeof(uint64_t),&address,sizeof(address));
+    }
+    for(size_t i = 0;i<callees.size();i++) {
+      UALMethod* callee = callees[i];
+      if(!callee->inBatch && callee->entry == 0 && std::find(stubQueue.begin(),stubQueue.end(),callee) == stubQueue.end()) {
+	stubQueue.push_back(callee);
+      }
+    }
+    codeSize = size;
+    importTableOffset = tableOffset;
+    nativefunc = native;
+    entry = native;
+    return true;
+  }
+#ifdef CODE_CACHE_DIR
+  /**
+   * @summary Stores the native code of this method in the code cache, along with its imports and constant pool
+   * @param code The native code, codeSize bytes starting at funcStart
+   * */
+  void WriteCache(const unsigned char* code) {
+    if(Cache_Directory().empty()) {
+      return;
+    }
+    std::string path = CachePath();
+    char mander[32];
+    sprintf(mander,".%i.tmp",(int)getpid());
+    std::string temp = path+mander;
+    std::vector<unsigned char> file(sizeof(CacheHeader));
+    uint32_t word = (uint32_t)codeSize;
+    Buffer_Append(file,word);
+    Buffer_Append(file,code,codeSize);
+    SaveImports(file);
+    CacheHeader header;
+    header.magic = CODE_CACHE_MAGIC;
+    header.version = CODE_CACHE_VERSION;
+    header.runtime = Cache_RuntimeHash();
+    header.key = cacheKey;
+    header.length = file.size()-sizeof(header);
+    header.checksum = Hash_Add(14695981039346656037ULL,file.data()+sizeof(header),header.length);
+    memcpy(file.data(),&header,sizeof(header));
+    int fd = open(temp.data(),O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW,0600);
+    if(fd < 0) {
+      return;
+    }
+    FILE* fp = fdopen(fd,"wb");
+    if(fp == 0) {
+      close(fd);
+      unlink(temp.data());
+      return;
+    }
+    bool ok = fwrite(file.data(),1,file.size(),fp) == file.size();
+    ok = fclose(fp) == 0 && ok;
+    //Renaming is atomic, so other processes never see half a file
+    if(!ok || rename(temp.data(),path.data()) != 0) {
+      unlink(temp.data());
+    }
+  }
+  /**
+   * @summary Loads the code of this method from the code cache, relocating its import table
+   * @returns False if the method is not in the cache (or its imports can no longer be resolved), and has to be compiled
+   * */
+  bool LoadCache() {
+    if(Cache_Directory().empty()) {
+      return false;
+    }
+    std::string path = CachePath();
+    FILE* fp = fopen(path.data(),"rb");
+    if(fp == 0) {
+      return false;
+    }
+    std::vector<unsigned char> file;
+    fseek(fp,0,SEEK_END);
+    long len = ftell(fp);
+    fseek(fp,0,SEEK_SET);
+    if(len > 0) {
+      file.resize(len);
+      if(fread(file.data(),1,len,fp) != (size_t)len) {
+	file.clear();
+      }
+    }
+    fclose(fp);
+    if(file.size() < sizeof(CacheHeader)) {
+      return false;
+    }
+    //Nothing in the file gets linked (let alone run) unless it is exactly what this runtime wrote for this method
+    CacheHeader header;
+    memcpy(&header,file.data(),sizeof(header));
+    size_t length = file.size()-sizeof(header);
+    if(header.magic != CODE_CACHE_MAGIC || header.version != CODE_CACHE_VERSION || header.runtime != Cache_RuntimeHash() || header.key != cacheKey ||
+      header.length != length || header.checksum != Hash_Add(14695981039346656037ULL,file.data()+sizeof(header),length)) {
+      return false;
+    }
+    try {
+      BStream reader(file.data()+sizeof(header),length);
+      uint32_t size;
+      reader.Read(size);
+      unsigned char* code = (unsigned char*)reader.Increment(size);
+      if(!LinkImports(reader,code,size,true)) {
+	return false;
+      }
+    }catch(const char* er) {
+      //Truncated file
+      return false;
+    }
+    //Entries which keep getting used are never pruned
+    utime(path.data(),0);
+    return true;
+  }
+#endif
+  bool parsed; //Whether or not the parse tree has been built
+  bool prepared; //Whether or not the parse tree has been optimized
+  /**
+   * @summary Frees the parse tree, and everything else allocated to emit it, in one go once the method has been compiled.
+   * Inlinable methods keep their trees, since callers compiled later splice them in (see InlineCall); no other method looks at the tree of a method which is not inlinable.
+   * */
+  void ReleaseTree() {
+    if(inlinable && !isOSR) {
+      return;
+    }
+    stack.clear();
+    instructions = 0;
+    lastInstruction = 0;
+    ualOffsets.Clear();
+    branchTargets.clear();
+    profileSlots.clear();
+    arg_regs = 0;
+    stackOffsetTable = 0;
+    arena.Release();
+  }
+  bool inBatch; //Whether or not this method is being compiled in the current batch
+  void ParseOnce() {
+    if(!parsed) {
+      parsed = true;
+      Parse();
+    }
+  }
+  /**
+   * @summary Builds and optimizes the parse tree of this method, once. Small callees are prepared first, so that they can be inlined without being compiled,
+   * and native callees are resolved here (rather than by Emit, which runs on several threads at once).
+   * */
+  void Prepare() {
+    if(prepared) {
+      return;
+    }
+    prepared = true;
+    ParseOnce();
+    std::vector<CallNode*> calls;
+    for(Node* inst = instructions;inst != 0;inst = inst->next) {
+      Node_FindCalls(inst,calls);
+    }
+    for(size_t i = 0;i<calls.size();i++) {
+      UALMethod* callee = calls[i]->method;
+      if(callee->isManaged && callee->str.len <= INLINE_BYTECODE_LIMIT) {
+	callee->Prepare();
+      }
+    }
     Optimize();
-    Emit();
+    //Inlining may have brought in calls of its own
+    calls.clear();
+    for(Node* inst = instructions;inst != 0;inst = inst->next) {
+      Node_FindCalls(inst,calls);
+    }
+    for(size_t i = 0;i<calls.size();i++) {
+      if(!calls[i]->method->isManaged) {
+	calls[i]->method->ResolveNative();
+      }
+    }
+  }
+  /**
+   * @summary Emits and links one part of a batch on the calling thread
+   * @param nativefuncs Receives the native code of each method in the part
+   * @param stubs Receives the stubs emitted for the methods this part calls which are not in the batch
+   * */
+  static void CompileChunk(const std::vector<UALMethod*>& chunk, std::vector<void*>& nativefuncs, std::vector<std::pair<UALMethod*,void*> >& stubs) {
+    JIT_EnsureContext();
+    for(size_t i = 0;i<chunk.size();i++) {
+      chunk[i]->funcStart = JITCompiler->newLabel();
+    }
+    for(size_t i = 0;i<chunk.size();i++) {
+      chunk[i]->Emit();
+    }
+    //Emitting a stub never queues another one
+    std::vector<asmjit::Label> stubLabels;
+    for(size_t i = 0;i<stubQueue.size();i++) {
+      stubLabels.push_back(stubQueue[i]->EmitStub());
+    }
+    JITCompiler->finalize();
+    size_t start;
+    {
+      std::lock_guard<std::mutex> guard(JITruntimeLock);
+      start = (size_t)JITAssembler->make();
+    }
+    for(size_t i = 0;i<chunk.size();i++) {
+      size_t offset = JITAssembler->getLabelOffset(chunk[i]->funcStart);
+      nativefuncs.push_back((void*)(start+offset));
+      chunk[i]->codeSize = JITAssembler->getLabelOffset(chunk[i]->funcEnd)-offset;
+      chunk[i]->importTableOffset = JITAssembler->getLabelOffset(chunk[i]->importTable)-offset;
+#ifdef CODE_CACHE_DIR
+      if(!chunk[i]->isOSR) {
+	chunk[i]->WriteCache((unsigned char*)(start+offset));
+      }
+#endif
+    }
+    for(size_t i = 0;i<stubQueue.size();i++) {
+      stubs.push_back(std::pair<UALMethod*,void*>(stubQueue[i],(void*)(start+JITAssembler->getLabelOffset(stubLabels[i]))));
+    }
+    stubQueue.clear();
+  }
+  /**
+   * @summary Compiles methods to native code (x86), on up to JIT_THREADS threads, or loads them from the code cache. Managed methods they call which have not been compiled are called through a stub instead, which compiles (or interprets) them on first call.
+   * Parsing and emitting run in parallel; optimizing does not, since inlining reads the optimized trees of callees. Methods call each other through their entries,
+   * which the final link step points at the new code.
+   * */
+  static void CompileBatch(const std::vector<UALMethod*>& methods) {
+    std::vector<UALMethod*> batch;
+    for(size_t i = 0;i<methods.size();i++) {
+      UALMethod* method = methods[i];
+      if(method->isManaged && method->nativefunc == 0 && !method->inBatch) {
+	method->inBatch = true;
+	batch.push_back(method);
+      }
+    }
+    if(batch.empty()) {
+      return;
+    }
+    //Whatever compiling prints (the JIT log, or why it gave up) comes after the output of the program so far
+    Console_Sync();
+#ifdef CODE_CACHE_DIR
+    //Methods compiled by an earlier run skip parsing and emitting altogether (except ahead of time, which needs the import records of every method)
+    if(!AOT_Building && !Cache_Directory().empty()) {
+      std::vector<UALMethod*> misses;
+      for(size_t i = 0;i<batch.size();i++) {
+	std::set<UALMethod*> visited;
+	batch[i]->cacheKey = batch[i]->HashCode(Cache_RuntimeHash(),visited);
+	if(batch[i]->LoadCache()) {
+	  batch[i]->inBatch = false;
+	}else {
+	  misses.push_back(batch[i]);
+	}
+      }
+      batch.swap(misses);
+      LinkStubs();
+      if(batch.empty()) {
+	return;
+      }
+    }
+#endif
+    //Methods of indexed modules are created when first called for (see UALModule::Method), which has to happen here rather than on the threads which parse
+    for(size_t i = 0;i<batch.size();i++) {
+      std::vector<UALMethod*> callees;
+      batch[i]->ScanCalls(callees);
+    }
+    size_t chunkCount = std::min(JIT_ThreadCount(),batch.size());
+    std::vector<std::vector<UALMethod*> > chunks(chunkCount);
+    for(size_t i = 0;i<batch.size();i++) {
+      chunks[i % chunkCount].push_back(batch[i]);
+    }
+    std::vector<std::function<void()> > jobs(chunkCount);
+    for(size_t c = 0;c<chunkCount;c++) {
+      std::vector<UALMethod*>* chunk = &chunks[c];
+      jobs[c] = [chunk]() {
+	for(size_t i = 0;i<chunk->size();i++) {
+	  (*chunk)[i]->ParseOnce();
+	}
+      };
+    }
+    JIT_RunJobs(jobs);
+    for(size_t i = 0;i<batch.size();i++) {
+      batch[i]->Prepare();
+    }
+    std::vector<std::vector<void*> > nativefuncs(chunkCount);
+    std::vector<std::vector<std::pair<UALMethod*,void*> > > stubs(chunkCount);
+    for(size_t c = 0;c<chunkCount;c++) {
+      std::vector<UALMethod*>* chunk = &chunks[c];
+      std::vector<void*>* chunkFuncs = &nativefuncs[c];
+      std::vector<std::pair<UALMethod*,void*> >* chunkStubs = &stubs[c];
+      jobs[c] = [chunk,chunkFuncs,chunkStubs]() {
+	CompileChunk(*chunk,*chunkFuncs,*chunkStubs);
+      };
+    }
+    JIT_RunJobs(jobs);
+    //Link
+    for(size_t c = 0;c<chunkCount;c++) {
+      for(size_t i = 0;i<chunks[c].size();i++) {
+	chunks[c][i]->nativefunc = nativefuncs[c][i];
+	chunks[c][i]->entry = nativefuncs[c][i];
+	chunks[c][i]->inBatch = false;
+	chunks[c][i]->ReleaseTree();
+      }
+    }
+    for(size_t c = 0;c<chunkCount;c++) {
+      for(size_t i = 0;i<stubs[c].size();i++) {
+	if(stubs[c][i].first->entry == 0) {
+	  stubs[c][i].first->entry = stubs[c][i].second;
+	}
+      }
+    }
+  }
+  
+  //Internal -- Emits the stubs queued while linking code compiled by another process, and points the entries which are still empty at them
+  static void LinkStubs() {
+    if(stubQueue.empty()) {
+      return;
+    }
+    std::vector<UALMethod*> none;
+    std::vector<void*> nativefuncs;
+    std::vector<std::pair<UALMethod*,void*> > stubs;
+    CompileChunk(none,nativefuncs,stubs);
+    for(size_t i = 0;i<stubs.size();i++) {
+      if(stubs[i].first->entry == 0) {
+	stubs[i].first->entry = stubs[i].second;
+      }
+    }
+  }
+  void* entry; //What JIT code calls to run this method: a stub until the method has been compiled, then its native code (NULL until either exists)
+  //Internal -- Emits the stub which JIT code calls until this method has been compiled. It spills the arguments to the stack, and passes them to Enter.
+  asmjit::Label EmitStub() {
+    asmjit::FuncBuilderX builder;
+    if(sig->returnType != TVoid) {
+      builder.setRet(asmjit::kVarTypeIntPtr);
+    }
+    for(size_t i = 0;i<sig->args.size();i++) {
+      builder.addArg(asmjit::kVarTypeIntPtr);
+    }
+    asmjit::Label stubStart = JITCompiler->newLabel();
+    JITCompiler->bind(stubStart);
+    JITCompiler->addFunc(builder);
+    asmjit::X86Mem spill = JITCompiler->newStack(sig->args.size() ? sig->args.size()*sizeof(uint64_t) : sizeof(uint64_t),8);
+    asmjit::X86GpVar addr = JITCompiler->newIntPtr();
+    JITCompiler->lea(addr,spill);
+    for(size_t i = 0;i<sig->args.size();i++) {
+      asmjit::X86GpVar arg = JITCompiler->newIntPtr();
+      JITCompiler->setArg(i,arg);
+      JITCompiler->mov(JITCompiler->intptr_ptr(addr,(int32_t)(i*sizeof(uint64_t))),arg);
+    }
+    asmjit::FuncBuilderX enter;
+    enter.setRet(asmjit::kVarTypeIntPtr);
+    enter.addArg(asmjit::kVarTypeIntPtr);
+    enter.addArg(asmjit::kVarTypeIntPtr);
+    asmjit::X86GpVar result = JITCompiler->newIntPtr();
+    asmjit::X86CallNode* call = JITCompiler->call((size_t)&Enter,enter);
+    call->setArg(0,asmjit::imm((size_t)this));
+    call->setArg(1,addr);
+    call->setRet(0,result);
+    if(sig->returnType != TVoid) {
+      JITCompiler->ret(result);
+    }else {
+      JITCompiler->ret();
+    }
+    JITCompiler->endFunc();
+    return stubStart;
+  }
+  /**
+   * @summary Where a stub sends a call to a method which has not been compiled yet. The method runs on the interpreter (and gets compiled once it is hot),
+   * or is compiled right away if the interpreter is disabled.
+   * */
+  static uint64_t Enter(UALMethod* method, uint64_t* args) {
+#ifdef INTERPRETER
+    return method->Interpret(args);
+#else
+    CompileBatch(std::vector<UALMethod*>(1,method));
+    return Native_Call(method->nativefunc,args,method->sig->args.size());
+#endif
   }
   
   void Parse() {
@@ -1266,6 +4482,7 @@ asmjit::X86FuncNode* fnode;
     unsigned char* base = str.ptr;
     
     BStream reader = str;
+    ualOffsets.Reset(arena,str.len);
     while(reader.Read(opcode) != 255) {
       ualip = (uint32_t)((size_t)reader.ptr-(size_t)base)-1;
       
@@ -1276,8 +4493,7 @@ asmjit::X86FuncNode* fnode;
 	  //Push argument to evaluation stack
 	  uint32_t index;
 	  reader.Read(index);
-	  std::string tname = sig.args[index];
-	  Node* sobj = Node_Stackop<LdArg>(index,tname.data());
+	  Node* sobj = Node_Stackop<LdArg>(index,sig->args[index]);
 	  
 	  
 	}
@@ -1288,23 +4504,25 @@ asmjit::X86FuncNode* fnode;
 	  uint32_t funcID;
 	  reader.Read(funcID);
 	  UALMethod* method = ResolveMethod(assembly,funcID);
-	  size_t argcount = method->sig.args.size();
-	  std::vector<Node*> args;
-	  args.resize(argcount);
+	  if(method == 0) {
+	    throw "Malformed UAL. Call to a method which does not exist.";
+	  }
+	  size_t argcount = method->sig->args.size();
+	  ArenaArray<Node*> args(arena,argcount);
 	  for(size_t i = 0;i<argcount;i++) {
 	    if(stack.size() == 0) {
 	      throw "Malformed UAL. Too few arguments in function call.";
 	    }
 	    args[argcount-i-1] = stack[stack.size()-1];
-	    if(args[argcount-i-1]->resultType != method->sig.args[argcount-i-1]) {
+	    if(args[argcount-i-1]->resultType != method->sig->args[argcount-i-1]) {
 	      throw "Malformed UAL. Illegal data type passed to function.";
 	    }
 	    stack.pop_back();
 	    Node_RemoveInstruction(args[argcount-i-1]);
 	  }
 	  Node* sobj = Node_Instruction<CallNode>(method,args);
-	  if(method->sig.returnType != "System.Void") {
-	    sobj->resultType = method->sig.returnType;
+	  if(method->sig->returnType != TVoid) {
+	    sobj->resultType = method->sig->returnType;
 	    stack.push_back(sobj); //Hybrid instruction
 	  }
 	  
@@ -1319,7 +4537,7 @@ asmjit::X86FuncNode* fnode;
 	  break;
 	case 3:
 	{
-	  if(this->sig.returnType == "System.Void") {
+	  if(this->sig->returnType == TVoid) {
 	    Node_Instruction<Ret>((Node*)0);
 	    //There should be nothing on stack
 	    if(stack.size()) {
@@ -1329,7 +4547,7 @@ asmjit::X86FuncNode* fnode;
 	      if(stack.size() != 1) {
 		throw "Malformed UAL. Function must return a value.";
 	      }
-	      if(stack[0]->resultType != this->sig.returnType) {
+	      if(stack[0]->resultType != this->sig->returnType) {
 		throw "Malformed UAL. Function does not return correct datatype.";
 	      }
 	      Node_Instruction<Ret>(Node_RemoveInstruction(stack[0]));
@@ -1358,7 +4576,7 @@ asmjit::X86FuncNode* fnode;
 	  Node* sval = stack[stack.size()-1];
 	  stack.pop_back();
 	  if(sval->resultType != this->locals[index]) {
-	    printf("Type mismatch %s != %s\n",sval->resultType.data(),this->locals[index].data());
+	    printf("Type mismatch %s != %s\n",TypeName(sval->resultType),TypeName(this->locals[index]));
 	    throw "Malformed UAL. Type mismatch on store to local variable.";
 	  }
 	  Node_Instruction<StLoc>(index,Node_RemoveInstruction(sval));
@@ -1381,8 +4599,7 @@ asmjit::X86FuncNode* fnode;
 	  //LDLOC
 	  uint32_t id;
 	  reader.Read(id);
-	  std::string tname = this->locals[id];
-	  Node_Stackop<LdLoc>(id,tname.data());
+	  Node_Stackop<LdLoc>(id,this->locals[id]);
 	}
 	  break;
 	case 8:
@@ -1397,7 +4614,7 @@ asmjit::X86FuncNode* fnode;
 	  if(left->resultType != right->resultType) {
 	    throw "Malformed UAL. Binary expressions require operands to be of same type.";
 	  }
-	  if(!(left->resultType == "System.Double" || left->resultType == "System.Int32")) {
+	  if(!(left->resultType == TDouble || left->resultType == TInt32)) {
 	    throw "Malformed UAL. Binary expressions can only operate on primitive types.";
 	  }
 	  Node_Stackop<BinaryExpression>('+',Node_RemoveInstruction(left),Node_RemoveInstruction(right));
@@ -1523,7 +4740,7 @@ asmjit::X86FuncNode* fnode;
 	  if(left->resultType != right->resultType) {
 	    throw "Malformed UAL. Binary expressions require operands to be of same type.";
 	  }
-	  if(!(left->resultType == "System.Double" || left->resultType == "System.Int32")) {
+	  if(!(left->resultType == TDouble || left->resultType == TInt32)) {
 	    throw "Malformed UAL. Binary expressions can only operate on primitive types.";
 	  }
 	  Node_Stackop<BinaryExpression>('-',Node_RemoveInstruction(left),Node_RemoveInstruction(right));
@@ -1544,7 +4761,7 @@ asmjit::X86FuncNode* fnode;
 	  if(left->resultType != right->resultType) {
 	    throw "Malformed UAL. Binary expressions require operands to be of same type.";
 	  }
-	  if(!(left->resultType == "System.Double" || left->resultType == "System.Int32")) {
+	  if(!(left->resultType == TDouble || left->resultType == TInt32)) {
 	    throw "Malformed UAL. Binary expressions can only operate on primitive types.";
 	  }
 	  Node_Stackop<BinaryExpression>('*',Node_RemoveInstruction(left),Node_RemoveInstruction(right));
@@ -1563,7 +4780,7 @@ asmjit::X86FuncNode* fnode;
 	  if(left->resultType != right->resultType) {
 	    throw "Malformed UAL. Binary expressions require operands to be of same type.";
 	  }
-	  if(!(left->resultType == "System.Double" || left->resultType == "System.Int32")) {
+	  if(!(left->resultType == TDouble || left->resultType == TInt32)) {
 	    throw "Malformed UAL. Binary expressions can only operate on primitive types.";
 	  }
 	  Node_Stackop<BinaryExpression>('/',Node_RemoveInstruction(left),Node_RemoveInstruction(right));
@@ -1583,7 +4800,7 @@ asmjit::X86FuncNode* fnode;
 	  if(left->resultType != right->resultType) {
 	    throw "Malformed UAL. Binary expressions require operands to be of same type.";
 	  }
-	  if(!(left->resultType == "System.Int32")) {
+	  if(!(left->resultType == TInt32)) {
 	    throw "Malformed UAL. Binary expressions can only operate on primitive types.";
 	  }
 	  Node_Stackop<BinaryExpression>('%',Node_RemoveInstruction(left),Node_RemoveInstruction(right));
@@ -1605,7 +4822,7 @@ asmjit::X86FuncNode* fnode;
 	  if(left->resultType != right->resultType) {
 	    throw "Malformed UAL. Binary expressions require operands to be of same type.";
 	  }
-	  if(!(left->resultType == "System.Int32")) {
+	  if(!(left->resultType == TInt32)) {
 	    throw "Malformed UAL. Binary expressions can only operate on primitive types.";
 	  }
 	  Node_Stackop<BinaryExpression>('<',Node_RemoveInstruction(left),Node_RemoveInstruction(right));
@@ -1629,7 +4846,7 @@ asmjit::X86FuncNode* fnode;
 	  if(left->resultType != right->resultType) {
 	    throw "Malformed UAL. Binary expressions require operands to be of same type.";
 	  }
-	  if(!(left->resultType == "System.Int32")) {
+	  if(!(left->resultType == TInt32)) {
 	    throw "Malformed UAL. Binary expressions can only operate on primitive types.";
 	  }
 	  Node_Stackop<BinaryExpression>('>',Node_RemoveInstruction(left),Node_RemoveInstruction(right));
@@ -1651,7 +4868,7 @@ asmjit::X86FuncNode* fnode;
 	  if(left->resultType != right->resultType) {
 	    throw "Malformed UAL. Binary expressions require operands to be of same type.";
 	  }
-	  if(!(left->resultType == "System.Int32")) {
+	  if(!(left->resultType == TInt32)) {
 	    throw "Malformed UAL. Binary expressions can only operate on primitive types.";
 	  }
 	  Node_Stackop<BinaryExpression>('&',Node_RemoveInstruction(left),Node_RemoveInstruction(right));
@@ -1672,7 +4889,7 @@ asmjit::X86FuncNode* fnode;
 	  if(left->resultType != right->resultType) {
 	    throw "Malformed UAL. Binary expressions require operands to be of same type.";
 	  }
-	  if(!(left->resultType == "System.Int32")) {
+	  if(!(left->resultType == TInt32)) {
 	    throw "Malformed UAL. Binary expressions can only operate on primitive types.";
 	  }
 	  Node_Stackop<BinaryExpression>('|',Node_RemoveInstruction(left),Node_RemoveInstruction(right));
@@ -1693,7 +4910,7 @@ asmjit::X86FuncNode* fnode;
 	  if(left->resultType != right->resultType) {
 	    throw "Malformed UAL. Binary expressions require operands to be of same type.";
 	  }
-	  if(!(left->resultType == "System.Int32")) {
+	  if(!(left->resultType == TInt32)) {
 	    throw "Malformed UAL. Binary expressions can only operate on primitive types.";
 	  }
 	  Node_Stackop<BinaryExpression>('~',Node_RemoveInstruction(left),Node_RemoveInstruction(right));
@@ -1708,7 +4925,8 @@ asmjit::X86FuncNode* fnode;
 	    throw "Malformed UAL. Expected at least one operand on the stack.";
 	  }
 	  Node* left = stack[stack.size()-1];
-	  if(!(left->resultType == "System.Int32")) {
+	  stack.pop_back();
+	  if(!(left->resultType == TInt32)) {
 	    throw "Malformed UAL. Binary expressions can only operate on primitive types.";
 	  }
 	  Node_Stackop<BinaryExpression>('!',Node_RemoveInstruction(left),(Node*)0);
@@ -1739,11 +4957,397 @@ asmjit::X86FuncNode* fnode;
       }
     }
     
-    velociraptor: //Back pain? Visit your GOTO Velociraptor today!
-    return;
+    velociraptor: //Back pain? Visit your GOTO Velociraptor today!
+    return;
+    
+  }
+  void* nativefunc;
+  
+  uint32_t invocationCount; //Calls to this method while it was being interpreted
+  uint32_t backedgeCount; //Backward branches taken while this method was being interpreted
+  std::map<const char*,size_t> interpretedConstants; //Address of a string or buffer literal in the bytecode -> index into the constant pool
+  
+  //Internal -- Compiles this method (and the managed methods it calls) once the interpreter has found it to be hot
+  void TierUp() {
+#ifdef DEBUGMODE
+    Console_Sync();
+    printf("Compiling hot method %s\n",sig->fullSignature.data());
+#endif
+    CompileBatch(std::vector<UALMethod*>(1,this));
+  }
+  NativeFunction* native; //The abi_ext function behind a native method (see ResolveNative); set before any code calling the method is emitted, which only reads it
+  /**
+   * @summary Looks up the abi_ext function behind this native method, once, and checks its C signature against the UAL one
+   * */
+  NativeFunction* ResolveNative() {
+    if(native) {
+      return native;
+    }
+    auto ext = abi_ext.find(sig->methodName);
+    if(ext == abi_ext.end()) {
+      throw "Unresolved native method.";
+    }
+    NativeFunction* func = &ext->second;
+    bool matches = func->args.size() == sig->args.size() && Native_Matches(func->returnType,sig->returnType);
+    for(size_t i = 0;matches && i<sig->args.size();i++) {
+      matches = Native_Matches(func->args[i],sig->args[i]);
+    }
+    if(!matches) {
+      throw "Native method does not match its UAL signature.";
+    }
+    native = func;
+    return native;
+  }
+  bool isOSR; //Whether or not this is a copy of a method which is entered at a loop header (see OSREntry)
+  uint32_t osrOffset; //The UAL offset an OSR copy is entered at
+  std::map<uint32_t,void*> osrEntries; //UAL offset of a loop header -> native code which resumes an interpreted activation there (NULL if it cannot)
+  /**
+   * @summary Compiles a copy of this method which is entered at a loop header rather than at its start, and takes over the arguments and locals
+   * of an activation running on the interpreter (on-stack replacement). The copy is optimized like the method itself, except that loop invariants
+   * are not hoisted, since entering at the header skips the preheader.
+   * @param offset The UAL offset of the loop header; the evaluation stack has to be empty there
+   * @returns The native code (uint64_t(uint64_t* args, uint64_t* locals)), or NULL if the activation cannot move to native code at that offset
+   * */
+  void* OSREntry(uint32_t offset) {
+    auto known = osrEntries.find(offset);
+    if(known != osrEntries.end()) {
+      return known->second;
+    }
+    osrEntries[offset] = 0;
+    for(size_t i = 0;i<localVarCount;i++) {
+      Type* tdef = ResolveType(locals[i]);
+      if(tdef->isStruct && tdef->size > sizeof(uint64_t)) {
+	return 0;
+      }
+    }
+#ifdef DEBUGMODE
+    Console_Sync();
+    printf("Replacing %s on the stack at %i\n",sig->fullSignature.data(),(int)offset);
+#endif
+    //The copy lives as long as its code, which uses its constant pool
+    UALMethod* copy = new UALMethod(definition,assembly,sig);
+    copy->isOSR = true;
+    copy->osrOffset = offset;
+    copy->Prepare();
+    Node* target = copy->ualOffsets.Find(offset);
+    if(target == 0) {
+      return 0;
+    }
+    std::map<Node*,Node*> owners;
+    for(Node* inst = copy->instructions;inst != 0;inst = inst->next) {
+      Node_MapOwners(inst,inst,owners);
+    }
+    if(owners.find(target) == owners.end()) {
+      return 0;
+    }
+    std::vector<void*> nativefuncs;
+    std::vector<std::pair<UALMethod*,void*> > stubs;
+    CompileChunk(std::vector<UALMethod*>(1,copy),nativefuncs,stubs);
+    copy->ReleaseTree();
+    for(size_t i = 0;i<stubs.size();i++) {
+      if(stubs[i].first->entry == 0) {
+	stubs[i].first->entry = stubs[i].second;
+      }
+    }
+    osrEntries[offset] = nativefuncs[0];
+    return nativefuncs[0];
+  }
+  //Internal -- Retrieves the constant pool index of a string literal in the bytecode, adding it on first use
+  size_t InterpretedString(const char* literal) {
+    auto slot = interpretedConstants.find(literal);
+    if(slot != interpretedConstants.end()) {
+      return slot->second;
+    }
+    size_t idx = GetString(literal);
+    interpretedConstants[literal] = idx;
+    return idx;
+  }
+  //Internal -- Retrieves the constant pool index of a buffer literal in the bytecode, adding it on first use
+  size_t InterpretedBuffer(void* bytes, size_t sz) {
+    auto slot = interpretedConstants.find((const char*)bytes);
+    if(slot != interpretedConstants.end()) {
+      return slot->second;
+    }
+    size_t idx = AllocBuffer(bytes,sz);
+    interpretedConstants[(const char*)bytes] = idx;
+    return idx;
+  }
+  
+  /**
+   * @summary Runs this method on the interpreter, straight from its bytecode. Counts calls and backward branches, and compiles the method once either gets hot; from then on its native code runs instead.
+   * @param args The arguments, encoded like they are in JIT code (System.Int32 sign-extended, System.Double as its bits, objects as pointers)
+   * @returns The return value, in the same encoding (0 for void methods)
+   * */
+  //The dispatch table holds label addresses, which are only valid for a single copy of the function.
+  __attribute__((noinline,noclone)) uint64_t Interpret(uint64_t* args) {
+    if(nativefunc == 0 && ++invocationCount >= TIER_UP_INVOCATIONS) {
+      TierUp();
+    }
+    if(nativefunc) {
+      return Native_Call(nativefunc,args,sig->args.size());
+    }
+    //Threaded code: every handler jumps straight to the handler of the next opcode
+    static void* dispatch[256];
+    static bool dispatchReady = false;
+    if(!dispatchReady) {
+      for(size_t i = 0;i<256;i++) {
+	dispatch[i] = &&op_unknown;
+      }
+      dispatch[0] = &&op_ldarg;
+      dispatch[1] = &&op_call;
+      dispatch[2] = &&op_ldstr;
+      dispatch[3] = &&op_ret;
+      dispatch[4] = &&op_ldint;
+      dispatch[5] = &&op_stloc;
+      dispatch[6] = &&op_br;
+      dispatch[7] = &&op_ldloc;
+      dispatch[8] = &&op_add;
+      dispatch[9] = &&op_ble;
+      dispatch[10] = &&op_nop;
+      dispatch[11] = &&op_beq;
+      dispatch[12] = &&op_bne;
+      dispatch[13] = &&op_bgt;
+      dispatch[14] = &&op_bge;
+      dispatch[15] = &&op_sub;
+      dispatch[16] = &&op_mul;
+      dispatch[17] = &&op_div;
+      dispatch[18] = &&op_rem;
+      dispatch[19] = &&op_shl;
+      dispatch[20] = &&op_shr;
+      dispatch[21] = &&op_and;
+      dispatch[22] = &&op_or;
+      dispatch[23] = &&op_xor;
+      dispatch[24] = &&op_not;
+      dispatch[25] = &&op_lddouble;
+      dispatch[26] = &&op_ldbuf;
+      dispatch[255] = &&op_end;
+      dispatchReady = true;
+    }
+    BStream reader = str;
+    unsigned char* base = str.ptr;
+    unsigned char opcode;
+    //The evaluation stack; types are only tracked to pick integer or floating point arithmetic
+    uint64_t values[INTERPRETER_STACK_SIZE];
+    TypeID types[INTERPRETER_STACK_SIZE];
+    size_t sp = 0;
+    //Only the declared locals; compiling the method while it runs here adds temporaries to localVarCount
+    std::vector<uint64_t> localValues(declaredLocalCount);
+    std::vector<bool> rooted(declaredLocalCount); //Managed locals which are registered as GC roots
+    uint64_t retval = 0;
+    uint32_t operand;
+    char op;
+    BranchCondition condition;
+    
+#define INTERP_NEXT() reader.Read(opcode); goto *dispatch[opcode]
+#define INTERP_PUSH(value,type) if(sp == INTERPRETER_STACK_SIZE) { throw "Malformed UAL. Evaluation stack overflow."; } values[sp] = (value); types[sp] = (type); sp++
+#define INTERP_NEED(count) if(sp < (count)) { throw "Malformed UAL. Expected operands on stack."; }
+    INTERP_NEXT();
+    
+    op_ldarg:
+      reader.Read(operand);
+      if(operand >= sig->args.size()) {
+	throw "Malformed UAL. Argument index out of range.";
+      }
+      INTERP_PUSH(args[operand],sig->args[operand]);
+      INTERP_NEXT();
+    op_call:
+    {
+      reader.Read(operand);
+      UALMethod* method = ResolveMethod(assembly,operand);
+      if(method == 0) {
+	throw "Malformed UAL. Call to a method which does not exist.";
+      }
+      size_t argcount = method->sig->args.size();
+      INTERP_NEED(argcount);
+      //Arguments are already in order on the evaluation stack (first argument deepest)
+      sp-=argcount;
+      uint64_t result;
+      if(method->isManaged) {
+	result = method->Interpret(values+sp);
+      }else {
+	result = ((uint64_t(*)(const uint64_t*))Native_Trampoline(method->ResolveNative()))(values+sp);
+      }
+      if(method->sig->returnType != TVoid) {
+	INTERP_PUSH(result,method->sig->returnType);
+      }
+    }
+      INTERP_NEXT();
+    op_ldstr:
+      //The constant pool may move while a literal is added, so look the index up first
+      operand = (uint32_t)InterpretedString(reader.ReadString());
+      INTERP_PUSH((uint64_t)constantStrings[operand],TString);
+      INTERP_NEXT();
+    op_ret:
+      if(sig->returnType != TVoid) {
+	INTERP_NEED(1);
+	retval = values[sp-1];
+      }
+      goto op_end;
+    op_ldint:
+      reader.Read(operand);
+      INTERP_PUSH((uint64_t)(int64_t)(int32_t)operand,TInt32);
+      INTERP_NEXT();
+    op_stloc:
+      reader.Read(operand);
+      if(operand >= declaredLocalCount) {
+	throw "Malformed UAL. Local variable index out of range.";
+      }
+      INTERP_NEED(1);
+      sp--;
+      localValues[operand] = values[sp];
+      if(!IsPromotedLocal(operand) && !rooted[operand]) {
+	GC_Mark((void**)&localValues[operand],true);
+	rooted[operand] = true;
+      }
+      INTERP_NEXT();
+    op_br:
+      reader.Read(operand);
+      goto jump;
+    op_ldloc:
+      reader.Read(operand);
+      if(operand >= declaredLocalCount) {
+	throw "Malformed UAL. Local variable index out of range.";
+      }
+      INTERP_PUSH(localValues[operand],locals[operand]);
+      INTERP_NEXT();
+    op_nop:
+      INTERP_NEXT();
+    op_lddouble:
+    {
+      double word;
+      reader.Read(word);
+      uint64_t bits;
+      memcpy(&bits,&word,sizeof(bits));
+      INTERP_PUSH(bits,TDouble);
+    }
+      INTERP_NEXT();
+    op_ldbuf:
+    {
+      reader.Read(operand);
+      void* bufferBytes = reader.Increment(operand);
+      operand = (uint32_t)InterpretedBuffer(bufferBytes,operand);
+      INTERP_PUSH((uint64_t)constantStrings[operand],TBlob);
+    }
+      INTERP_NEXT();
+    op_not:
+      INTERP_NEED(1);
+      values[sp-1] = (uint64_t)(int64_t)~(int32_t)values[sp-1];
+      INTERP_NEXT();
+    
+    op_add: op = '+'; goto binary;
+    op_sub: op = '-'; goto binary;
+    op_mul: op = '*'; goto binary;
+    op_div: op = '/'; goto binary;
+    op_rem: op = '%'; goto binary;
+    op_shl: op = '<'; goto binary;
+    op_shr: op = '>'; goto binary;
+    op_and: op = '&'; goto binary;
+    op_or: op = '|'; goto binary;
+    op_xor: op = '~'; goto binary;
+    binary:
+    {
+      //The Republican (first operand pushed) is deeper on the stack than the Democrat
+      INTERP_NEED(2);
+      sp--;
+      uint64_t left = values[sp];
+      uint64_t right = values[sp-1];
+      if(types[sp-1] == TDouble) {
+	double a;
+	double b;
+	memcpy(&a,&right,sizeof(a));
+	memcpy(&b,&left,sizeof(b));
+	switch(op) {
+	  case '+':
+	    a+=b;
+	    break;
+	  case '-':
+	    a-=b;
+	    break;
+	  case '*':
+	    a*=b;
+	    break;
+	  case '/':
+	    a/=b;
+	    break;
+	  default:
+	    throw "Malformed UAL. Binary expressions can only operate on primitive types.";
+	}
+	memcpy(&values[sp-1],&a,sizeof(a));
+      }else {
+	int32_t result;
+	if(!FoldInt(op,(int32_t)right,(int32_t)left,result)) {
+	  Int32_DivideFault();
+	}
+	values[sp-1] = (uint64_t)(int64_t)result;
+      }
+    }
+      INTERP_NEXT();
     
+    op_ble: condition = Ble; goto compare;
+    op_beq: condition = Beq; goto compare;
+    op_bne: condition = Bne; goto compare;
+    op_bgt: condition = Bgt; goto compare;
+    op_bge: condition = Bge; goto compare;
+    compare:
+    {
+      reader.Read(operand);
+      INTERP_NEED(2);
+      sp-=2;
+      uint64_t right = values[sp];
+      uint64_t left = values[sp+1];
+      bool taken;
+      if(types[sp] == TDouble) {
+	double a;
+	double b;
+	memcpy(&a,&right,sizeof(a));
+	memcpy(&b,&left,sizeof(b));
+	taken = FoldCondition(condition,a,b);
+      }else {
+	//System.Int32 is sign-extended, so comparing all 64 bits works for integers and object references alike
+	taken = FoldCondition(condition,(int64_t)right,(int64_t)left);
+      }
+      if(!taken) {
+	INTERP_NEXT();
+      }
+    }
+    jump:
+      if(operand >= str.len) {
+	throw "Illegal UAL offset";
+      }
+      if(base+operand < reader.ptr) {
+	if(nativefunc == 0 && ++backedgeCount >= TIER_UP_BACKEDGES) {
+	  TierUp();
+	}
+	if(nativefunc && sp == 0) {
+	  //The method has been compiled while this activation kept looping; move it to native code instead of finishing the loop here
+	  void* osr = OSREntry(operand);
+	  if(osr) {
+	    retval = ((uint64_t(*)(uint64_t*,uint64_t*))osr)(args,localValues.data());
+	    if(sig->returnType == TVoid) {
+	      retval = 0;
+	    }
+	    goto op_end;
+	  }
+	}
+      }
+      reader.ptr = base+operand;
+      reader.len = str.len-operand;
+      INTERP_NEXT();
+      
+    op_unknown:
+      Console_Sync();
+      printf("Unknown OPCODE %i\n",(int)opcode);
+    op_end:
+#undef INTERP_NEXT
+#undef INTERP_PUSH
+#undef INTERP_NEED
+    for(size_t i = 0;i<declaredLocalCount;i++) {
+      if(rooted[i]) {
+	GC_Unmark((void**)&localValues[i],true);
+      }
+    }
+    return retval;
   }
-  void* nativefunc;
   
   /**
    * @summary Invokes this method with the specified arguments
@@ -1752,12 +5356,19 @@ asmjit::X86FuncNode* fnode;
   void Invoke(GC_Array_Header* arglist) {
     
     if(!isManaged) {
-      Ext_Invoke(sig.methodName.data(), arglist);
+      uint64_t arg = (uint64_t)arglist;
+      ((uint64_t(*)(const uint64_t*))Native_Trampoline(ResolveNative()))(&arg);
       return;
       
     }
     if(nativefunc == 0) {
-      throw "up";
+#ifdef INTERPRETER
+      uint64_t arg = (uint64_t)arglist;
+      Interpret(&arg);
+      return;
+#else
+      CompileBatch(std::vector<UALMethod*>(1,this));
+#endif
     }
     ((void(*)(void*))nativefunc)(arglist);
     return;
@@ -1765,41 +5376,47 @@ asmjit::X86FuncNode* fnode;
   }
   ~UALMethod() {
    // delete JITCompiler;
-    size_t l = nodes.size();
-    for(size_t i = 0;i<l;i++) {
-      delete nodes[i];
-    }
+    //The parse tree goes with the arena
     
     for(size_t i = 0;i<stringCount;i++) {
       GC_Unmark((void**)(constantStrings+i),true);
     }
     delete[] constantStrings;
+    for(size_t i = 0;i<cachedPoolCount;i++) {
+      GC_Unmark((void**)(cachedPool+i),true);
+    }
+    delete[] cachedPool;
   }
 }; 
 
-static std::map<std::string,UALMethod*> methodCache;
 class UALType:public Type {
 public:
   
   BStream bstr; //in-memory view of file
-  bool compiled; //Whether or not this module has been compiled or interpreted
+  bool loaded; //Whether or not the methods of this type have been read in
   UALModule* module;
-  std::map<std::string,UALMethod*> methods;
+  std::vector<UALMethod*> methods; //In the order of the module
   UALType(BStream& str, UALModule* module) {
     bstr = str;
-    compiled = false;
+    loaded = false;
     this->module = module;
     
   }
+  //A type of an indexed module, whose methods the module creates as they are used
+  UALType(UALModule* module) {
+    loaded = true;
+    this->module = module;
+  }
   UALType() {
     //Special case: Builtin type.
-    compiled = true;
+    loaded = true;
   }
   /**
-   * @summary Compiles this UAL type to native code (x86), or interprets
+   * @summary Reads in the methods of this type. Nothing is compiled until a method is first called.
    * */
-  void Compile() {
-    if(!compiled) {
+  void Load() {
+    if(!loaded) {
+    loaded = true;
     uint32_t count;
     bstr.Read(count);
     size_t nativeCount = count; //Copy to size_t for faster performance
@@ -1809,46 +5426,150 @@ public:
       bstr.Read(mlen);
       
       void* ptr = bstr.Increment(mlen);
-      UALMethod* method = new UALMethod(BStream(ptr,mlen),module,mname);
-      
-      method->sig = mname;
-      methods[mname] = method;
-      methodCache[mname] = method;
-      
-      if(method->isManaged) {
-	method->Compile();
-	
-      }
+      UALMethod* method = new UALMethod(BStream(ptr,mlen),module,InternSignature(mname));
+      method->sig->method = method;
+      methods.push_back(method);
       
     }
-    
-    
-      JITCompiler->finalize();
-      size_t start = (size_t)JITAssembler->make();
-      for(auto i = methods.begin();i != methods.end();i++) {
-	UALMethod* meth = i->second;
-	meth->nativefunc = (void*)(start+JITAssembler->getLabelOffset(meth->funcStart));
-      }
-    
     }
   }
 };
 
 
-static std::map<std::string,Type*> typeCache; //Cache of types
-Type* ResolveType(const char* name)
+static std::map<std::string,TypeID> typeIds; //Type name -> interned ID
+static std::vector<std::string> typeNames; //Interned ID -> type name
+static std::vector<Type*> typeCache; //Interned ID -> type definition (NULL until the type has been loaded)
+
+/**
+ * @summary Interns a type name
+ * @param name The fully-qualified name of the type
+ * @returns The ID of the type. The same name always yields the same ID, whether or not the type has been loaded yet.
+ * */
+TypeID InternType(const char* name)
+{
+  if(typeNames.empty()) {
+    //Seed the well-known types so that their IDs match BuiltinTypeID
+    const char* builtins[] = {"System.Void","System.Int32","System.Double","System.String","System.Blob"};
+    for(size_t i = 0;i<sizeof(builtins)/sizeof(*builtins);i++) {
+      typeIds[builtins[i]] = (TypeID)typeNames.size();
+      typeNames.push_back(builtins[i]);
+      typeCache.push_back(0);
+    }
+  }
+  auto it = typeIds.find(name);
+  if(it != typeIds.end()) {
+    return it->second;
+  }
+  TypeID id = (TypeID)typeNames.size();
+  typeIds[name] = id;
+  typeNames.push_back(name);
+  typeCache.push_back(0);
+  return id;
+}
+const char* TypeName(TypeID id)
+{
+  return typeNames[id].data();
+}
+Type* ResolveType(TypeID id)
+{
+  return typeCache[id];
+}
+//Registers a type definition under its (interned) name
+static void RegisterType(Type* type)
 {
-  return typeCache[name];
+  typeCache[InternType(type->name.data())] = type;
+}
+
+/**
+ * The indexed module format. Everything is little-endian, and offsets are from the start of the file.
+ * A UALIndexHeader comes first, followed by its section directory (an array of UALSection). Each section is one of UALSectionID;
+ * sections the runtime does not know are skipped.
+ * */
+enum UALSectionID {
+  UALSectionStrings = 1, //NULL-terminated names, referred to by their offset in the section
+  UALSectionTypes = 2, //A UALTypeRecord per type
+  UALSectionMethods = 3, //A UALMethodRecord per method, grouped by type
+  UALSectionImports = 4, //The first method handle, followed by a UALImportRecord per handle from there on
+  UALSectionHashes = 5, //Bucket count, then buckets and chains (as in ELF) of method indices, by the Index_Hash of each signature
+  UALSectionCode = 6 //The methods themselves, as in the original format
+};
+#define UAL_INDEX_NONE 0xFFFFFFFF //No string, method or type
+struct UALIndexHeader {
+  uint32_t magic; //UAL_INDEX_MAGIC
+  uint32_t version; //UAL_INDEX_VERSION
+  uint32_t sectionCount;
+  uint32_t entryPoint; //Index of Main
+};
+struct UALSection {
+  uint32_t id;
+  uint32_t offset;
+  uint32_t length;
+};
+struct UALTypeRecord {
+  uint32_t name;
+  uint32_t firstMethod;
+  uint32_t methodCount;
+};
+struct UALMethodRecord {
+  uint32_t signature;
+  uint32_t type;
+  uint32_t offset; //Where the method starts in the file
+  uint32_t length;
+};
+struct UALImportRecord {
+  uint32_t signature; //UAL_INDEX_NONE for handles which are not in use
+  uint32_t method; //Index of the method, or UAL_INDEX_NONE if it is in another module
+};
+//Internal -- Hashes a method signature for the hash section of an indexed module
+static uint32_t Index_Hash(const char* signature) {
+  return (uint32_t)Hash_Add(14695981039346656037ULL,signature,strlen(signature));
+}
+//Internal -- Reads the record at an index of a section of an indexed module
+template<typename T>
+static T Index_Record(const BStream& section, size_t index) {
+  if(index >= section.len/sizeof(T)) {
+    throw "Malformed UAL. Index out of range.";
+  }
+  T retval;
+  memcpy(&retval,section.ptr+index*sizeof(T),sizeof(T));
+  return retval;
 }
 
+class UALModule;
+static std::vector<UALModule*> loadedModules;
+
 class UALModule {
 public:
   std::map<std::string,UALType*> types;
-  std::map<uint32_t,std::string> methodImports;
+  std::map<uint32_t,MethodSignature*> methodImports; //Method handle -> signature
+  void* bytecode;
+  size_t length;
+  bool indexed; //Whether or not this module is in the indexed format, whose methods are created on first use
+  //BEGIN Indexed format
+  BStream stringSection;
+  BStream typeSection;
+  BStream methodSection;
+  BStream importSection;
+  BStream hashSection;
+  uint32_t firstHandle; //The method handle of the first import record
+  uint32_t entryPoint;
+  std::vector<UALType*> typeTable; //Index -> type
+  std::vector<UALMethod*> methodTable; //Index -> method (NULL until first used)
+  //END Indexed format
   
   UALModule(void* bytecode, size_t len) {
+    this->bytecode = bytecode;
+    this->length = len;
+    this->indexed = false;
+    this->firstHandle = 0;
+    this->entryPoint = UAL_INDEX_NONE;
+    loadedModules.push_back(this);
     BStream str(bytecode,len);
     uint32_t count;
+    if(len>=sizeof(count) && *(uint32_t*)bytecode == UAL_INDEX_MAGIC) {
+      LoadIndex();
+      return;
+    }
     str.Read(count);
 #ifdef DEBUGMODE
     printf("Reading in %i classes\n",(int)count);
@@ -1864,8 +5585,9 @@ public:
       printf("Loading %s\n",name);
       #endif
       UALType* type = new UALType(obj,this);
+      type->name = name;
       types[std::string(name)] = type;
-      typeCache[std::string(name)] = type;
+      RegisterType(type);
       
       
     }
@@ -1876,29 +5598,415 @@ public:
       uint32_t id;
       str.Read(id);
       char* methodName = str.ReadString();
-      methodImports[id] = methodName;
+      methodImports[id] = InternSignature(methodName);
       printf("Found %s\n",methodName);
     }
     
   }
-  void LoadMain(int argc, char** argv) {
-    //Find main
-      UALType* mainClass = 0;
-      UALMethod* mainMethod = 0;
-      for(auto i = types.begin();i!= types.end();i++) {
-	i->second->Compile();
-	for(auto bot = i->second->methods.begin();bot != i->second->methods.end();bot++) {
-	  MethodSignature sig(bot->first.c_str());
-	  if(sig.methodName == "Main" && sig.args.size() == 1) {
-	    if(sig.args[0] == "System.String[]") {
-	      mainMethod = bot->second;
-	      mainClass = i->second;
-	    }
-	  }
+  /**
+   * @summary Reads the header and section directory of an indexed module, and creates its types.
+   * Methods are left alone until something looks them up, so only the pages holding the index and the code which runs are ever touched.
+   * */
+  void LoadIndex() {
+    indexed = true;
+    BStream str(bytecode,length);
+    UALIndexHeader header;
+    str.Read(header);
+    if(header.version != UAL_INDEX_VERSION) {
+      throw "Unsupported UAL module version. Rebuild the module for this runtime.";
+    }
+    for(uint32_t i = 0;i<header.sectionCount;i++) {
+      UALSection section;
+      str.Read(section);
+      if(section.offset>length || section.length>length-section.offset) {
+	throw "Malformed UAL. Section out of bounds.";
+      }
+      BStream view((unsigned char*)bytecode+section.offset,section.length);
+      switch(section.id) {
+	case UALSectionStrings:
+	  stringSection = view;
+	  break;
+	case UALSectionTypes:
+	  typeSection = view;
+	  break;
+	case UALSectionMethods:
+	  methodSection = view;
+	  break;
+	case UALSectionImports:
+	  view.Read(firstHandle);
+	  importSection = view;
+	  break;
+	case UALSectionHashes:
+	  hashSection = view;
+	  break;
+      }
+    }
+    entryPoint = header.entryPoint;
+    methodTable.resize(methodSection.len/sizeof(UALMethodRecord));
+    //Types are only a name each; ResolveType needs all of them
+    size_t typeCount = typeSection.len/sizeof(UALTypeRecord);
+    for(size_t i = 0;i<typeCount;i++) {
+      UALTypeRecord record = Index_Record<UALTypeRecord>(typeSection,i);
+      UALType* type = new UALType(this);
+      type->name = String(record.name);
+      types[type->name] = type;
+      typeTable.push_back(type);
+      RegisterType(type);
+    }
+  }
+  //Retrieves a string of an indexed module
+  const char* String(uint32_t offset) {
+    if(offset>=stringSection.len || strnlen((char*)stringSection.ptr+offset,stringSection.len-offset) == stringSection.len-offset) {
+      throw "Malformed UAL. String out of bounds.";
+    }
+    return (const char*)stringSection.ptr+offset;
+  }
+  /**
+   * @summary Retrieves a method of an indexed module, creating it on first use.
+   * Methods are only created on the thread which loads the module (see UALMethod::CompileBatch), so that the threads which compile can look them up without locking.
+   * @returns The method, or NULL if there is no such method
+   * */
+  UALMethod* Method(uint32_t index) {
+    if(index >= methodTable.size()) {
+      return 0;
+    }
+    if(methodTable[index] == 0) {
+      UALMethodRecord record = Index_Record<UALMethodRecord>(methodSection,index);
+      if(record.offset>length || record.length>length-record.offset || record.type>=typeTable.size()) {
+	throw "Malformed UAL. Method out of bounds.";
+      }
+      const char* mname = String(record.signature);
+      UALMethod* method = new UALMethod(BStream((unsigned char*)bytecode+record.offset,record.length),this,InternSignature(mname));
+      method->sig->method = method;
+      typeTable[record.type]->methods.push_back(method);
+      methodTable[index] = method;
+    }
+    return methodTable[index];
+  }
+  //Finds a method of an indexed module by its signature, through the hash section (NULL if it has none)
+  UALMethod* FindIndexed(const char* signature) {
+    if(hashSection.len<sizeof(uint32_t)) {
+      return 0;
+    }
+    BStream table = hashSection;
+    uint32_t bucketCount;
+    table.Read(bucketCount);
+    if(bucketCount == 0) {
+      return 0;
+    }
+    uint32_t index = Index_Record<uint32_t>(table,Index_Hash(signature) % bucketCount);
+    //Bound the walk, in case the chains of a malformed module loop
+    for(size_t steps = 0;index != UAL_INDEX_NONE && steps<methodTable.size();steps++) {
+      UALMethodRecord record = Index_Record<UALMethodRecord>(methodSection,index);
+      if(strcmp(String(record.signature),signature) == 0) {
+	return Method(index);
+      }
+      index = Index_Record<uint32_t>(table,(size_t)bucketCount+index);
+    }
+    return 0;
+  }
+  //Retrieves the method a handle in the bytecode of an indexed module refers to
+  UALMethod* ResolveImport(uint32_t handle) {
+    if(handle<firstHandle || handle-firstHandle >= importSection.len/sizeof(UALImportRecord)) {
+      return 0;
+    }
+    UALImportRecord record = Index_Record<UALImportRecord>(importSection,handle-firstHandle);
+    if(record.method != UAL_INDEX_NONE) {
+      return Method(record.method);
+    }
+    if(record.signature != UAL_INDEX_NONE) {
+      return FindMethod(String(record.signature));
+    }
+    return 0;
+  }
+  //Retrieves every method of this module, reading in (or creating) the ones which are not loaded yet
+  void Methods(std::vector<UALMethod*>& output) {
+    if(indexed) {
+      for(uint32_t i = 0;i<methodTable.size();i++) {
+	output.push_back(Method(i));
+      }
+      return;
+    }
+    for(auto i = types.begin();i!= types.end();i++) {
+      i->second->Load();
+      output.insert(output.end(),i->second->methods.begin(),i->second->methods.end());
+    }
+  }
+  /**
+   * @summary Finds static void Main(System.String[])
+   * @returns Main, or NULL if this module has none
+   * */
+  UALMethod* FindMain() {
+    if(indexed) {
+      return Method(entryPoint);
+    }
+    //Every method has to be known before any is parsed, so that calls resolve
+    for(auto i = types.begin();i!= types.end();i++) {
+      i->second->Load();
+    }
+    TypeID stringArray = InternType("System.String[]");
+    for(auto i = types.begin();i!= types.end();i++) {
+      for(size_t m = 0;m<i->second->methods.size();m++) {
+	MethodSignature* sig = i->second->methods[m]->sig;
+	if(sig->methodName == "Main" && sig->args.size() == 1 && sig->args[0] == stringArray) {
+	  return i->second->methods[m];
 	}
-	
       }
-      if(mainClass == 0) {
+    }
+    return 0;
+  }
+  /**
+   * @summary Writes this module in the indexed format, which UALRunner loads on demand (UALRunner --index <program> <output>)
+   * @returns False if the module could not be written
+   * */
+  bool SaveIndexed(const char* path) {
+    UALMethod* mainMethod = FindMain();
+    std::vector<unsigned char> strings;
+    std::map<std::string,uint32_t> stringOffsets;
+    auto intern = [&](const std::string& value) {
+      auto known = stringOffsets.find(value);
+      if(known != stringOffsets.end()) {
+	return known->second;
+      }
+      uint32_t offset = (uint32_t)strings.size();
+      Buffer_Append(strings,value.data(),value.size()+1);
+      stringOffsets[value] = offset;
+      return offset;
+    };
+    std::vector<UALTypeRecord> typeRecords;
+    std::vector<UALMethodRecord> methodRecords;
+    std::vector<UALMethod*> methods;
+    std::map<UALMethod*,uint32_t> methodIndices;
+    for(auto i = types.begin();i!= types.end();i++) {
+      UALTypeRecord type;
+      type.name = intern(i->first);
+      type.firstMethod = (uint32_t)methodRecords.size();
+      type.methodCount = (uint32_t)i->second->methods.size();
+      for(size_t m = 0;m<i->second->methods.size();m++) {
+	UALMethod* bot = i->second->methods[m];
+	UALMethodRecord method;
+	method.signature = intern(bot->sig->fullSignature);
+	method.type = (uint32_t)typeRecords.size();
+	method.length = (uint32_t)bot->definition.len;
+	methodIndices[bot] = (uint32_t)methodRecords.size();
+	methodRecords.push_back(method);
+	methods.push_back(bot);
+      }
+      typeRecords.push_back(type);
+    }
+    std::vector<UALImportRecord> importRecords;
+    uint32_t first = methodImports.empty() ? 0 : methodImports.begin()->first;
+    for(auto i = methodImports.begin();i != methodImports.end();i++) {
+      UALImportRecord unused;
+      unused.signature = UAL_INDEX_NONE;
+      unused.method = UAL_INDEX_NONE;
+      importRecords.resize(i->first-first+1,unused);
+      UALImportRecord& import = importRecords.back();
+      import.signature = intern(i->second->fullSignature);
+      auto method = methodIndices.find(i->second->method);
+      import.method = method == methodIndices.end() ? UAL_INDEX_NONE : method->second;
+    }
+    uint32_t bucketCount = std::max((uint32_t)methodRecords.size(),(uint32_t)1);
+    std::vector<uint32_t> hashes(1+bucketCount+methodRecords.size(),UAL_INDEX_NONE);
+    hashes[0] = bucketCount;
+    for(size_t i = methodRecords.size();i-- > 0;) {
+      uint32_t bucket = Index_Hash(methods[i]->sig->fullSignature.data()) % bucketCount;
+      hashes[1+bucketCount+i] = hashes[1+bucket];
+      hashes[1+bucket] = (uint32_t)i;
+    }
+    //The index goes in front of the code, so that loading touches as few pages as possible
+    UALSectionID ids[6] = {UALSectionStrings,UALSectionTypes,UALSectionMethods,UALSectionImports,UALSectionHashes,UALSectionCode};
+    UALSection sections[6];
+    size_t codeSize = 0;
+    for(size_t i = 0;i<methods.size();i++) {
+      codeSize+=methods[i]->definition.len;
+    }
+    size_t sizes[6] = {strings.size(),typeRecords.size()*sizeof(UALTypeRecord),methodRecords.size()*sizeof(UALMethodRecord),
+      sizeof(first)+importRecords.size()*sizeof(UALImportRecord),hashes.size()*sizeof(uint32_t),codeSize};
+    size_t offset = sizeof(UALIndexHeader)+sizeof(sections);
+    for(size_t i = 0;i<6;i++) {
+      offset = (offset+15) & ~(size_t)15;
+      sections[i].id = ids[i];
+      sections[i].offset = (uint32_t)offset;
+      sections[i].length = (uint32_t)sizes[i];
+      offset+=sizes[i];
+    }
+    offset = sections[5].offset;
+    for(size_t i = 0;i<methods.size();i++) {
+      methodRecords[i].offset = (uint32_t)offset;
+      offset+=methods[i]->definition.len;
+    }
+    std::vector<unsigned char> file(sections[0].offset);
+    Buffer_Append(file,strings.data(),strings.size());
+    file.resize(sections[1].offset);
+    Buffer_Append(file,typeRecords.data(),sizes[1]);
+    file.resize(sections[2].offset);
+    Buffer_Append(file,methodRecords.data(),sizes[2]);
+    file.resize(sections[3].offset);
+    Buffer_Append(file,first);
+    Buffer_Append(file,importRecords.data(),importRecords.size()*sizeof(UALImportRecord));
+    file.resize(sections[4].offset);
+    Buffer_Append(file,hashes.data(),sizes[4]);
+    file.resize(sections[5].offset);
+    for(size_t i = 0;i<methods.size();i++) {
+      Buffer_Append(file,methods[i]->definition.ptr,methods[i]->definition.len);
+    }
+    UALIndexHeader header;
+    header.magic = UAL_INDEX_MAGIC;
+    header.version = UAL_INDEX_VERSION;
+    header.sectionCount = 6;
+    header.entryPoint = mainMethod ? methodIndices[mainMethod] : UAL_INDEX_NONE;
+    memcpy(file.data(),&header,sizeof(header));
+    memcpy(file.data()+sizeof(header),sections,sizeof(sections));
+    FILE* fp = fopen(path,"wb");
+    if(fp == 0) {
+      return false;
+    }
+    bool ok = fwrite(file.data(),1,file.size(),fp) == file.size();
+    return fclose(fp) == 0 && ok;
+  }
+  /**
+   * @summary Compiles every managed method of every type in this module to native code (x86) up front, in parallel
+   * */
+  void Compile() {
+    std::vector<UALMethod*> methods;
+    std::vector<UALMethod*> managed;
+    Methods(methods);
+    for(size_t i = 0;i<methods.size();i++) {
+      if(methods[i]->isManaged) {
+	managed.push_back(methods[i]);
+      }
+    }
+    UALMethod::CompileBatch(managed);
+  }
+  /**
+   * @summary Compiles this module ahead of time, to a shared object which the runner can load instead of the UAL (see LoadNative).
+   * Every method is exported under its signature; the UAL_AOT symbol holds the UAL itself, followed by the import records and constant pool of each method.
+   * @returns False if the shared object could not be written
+   * */
+  bool SaveNative(const char* path) {
+    AOT_Building = true;
+    Compile();
+    AOT_Building = false;
+    std::vector<UALMethod*> methods;
+    std::vector<UALMethod*> managed;
+    Methods(methods);
+    for(size_t i = 0;i<methods.size();i++) {
+      if(methods[i]->isManaged && methods[i]->nativefunc) {
+	managed.push_back(methods[i]);
+      }
+    }
+    std::vector<unsigned char> image;
+    std::vector<ELFSymbol> symbols;
+    std::vector<unsigned char> table;
+    uint64_t hash = Cache_RuntimeHash();
+    Buffer_Append(table,hash);
+    uint32_t word = (uint32_t)length;
+    Buffer_Append(table,word);
+    Buffer_Append(table,bytecode,length);
+    word = (uint32_t)managed.size();
+    Buffer_Append(table,word);
+    for(size_t i = 0;i<managed.size();i++) {
+      UALMethod* method = managed[i];
+      while(image.size() % 16) {
+	image.push_back(0xCC); //int3
+      }
+      ELFSymbol symbol;
+      symbol.name = method->sig->fullSignature;
+      symbol.offset = image.size();
+      symbol.size = method->codeSize;
+      symbol.isFunction = true;
+      symbols.push_back(symbol);
+      Buffer_Append(image,method->nativefunc,method->codeSize);
+      //The import table holds addresses in this process; LoadNative fills it in
+      memset(image.data()+symbol.offset+method->importTableOffset,0,method->imports.size()*sizeof(uint64_t));
+      Buffer_Append(table,symbol.name.data(),symbol.name.size()+1);
+      word = (uint32_t)method->codeSize;
+      Buffer_Append(table,word);
+      method->SaveImports(table);
+    }
+    while(image.size() % 16) {
+      image.push_back(0);
+    }
+    ELFSymbol symbol;
+    symbol.name = "UAL_AOT";
+    symbol.offset = image.size();
+    symbol.isFunction = false;
+    uint32_t header[2] = {AOT_MAGIC,(uint32_t)table.size()};
+    Buffer_Append(image,header,sizeof(header));
+    image.insert(image.end(),table.begin(),table.end());
+    symbol.size = image.size()-symbol.offset;
+    symbols.push_back(symbol);
+    return ELF_Write(path,image,symbols);
+  }
+  /**
+   * @summary Loads a module compiled ahead of time by SaveNative. Its code runs from where dlopen maps it, so nothing gets compiled (besides stubs for methods it lacks).
+   * Code compiled by another version of the code generator (or for a CPU without the features it uses) is ignored, and the UAL embedded with it runs instead.
+   * @returns The module, or NULL if it could not be loaded
+   * */
+  static UALModule* LoadNative(const char* path) {
+    std::string filename = path;
+    if(filename.find('/') == std::string::npos) {
+      filename = "./"+filename; //Otherwise dlopen searches the library path
+    }
+    void* handle = dlopen(filename.data(),RTLD_NOW | RTLD_LOCAL);
+    if(handle == 0) {
+      printf("Error: %s\n",dlerror());
+      return 0;
+    }
+    unsigned char* image = (unsigned char*)dlsym(handle,"UAL_AOT");
+    uint32_t header[2];
+    if(image) {
+      memcpy(header,image,sizeof(header));
+    }
+    if(image == 0 || header[0] != AOT_MAGIC) {
+      printf("Error: %s is not a compiled UAL module.\n",path);
+      return 0;
+    }
+    BStream reader(image+sizeof(header),header[1]);
+    uint64_t hash;
+    reader.Read(hash);
+    uint32_t len;
+    reader.Read(len);
+    //The UAL stays mapped along with the shared object
+    UALModule* module = new UALModule(reader.Increment(len),len);
+    if(hash != Cache_RuntimeHash()) {
+#ifdef DEBUGMODE
+      printf("%s was compiled by another version of the runtime, or for another CPU; compiling its UAL instead\n",path);
+#endif
+      return module;
+    }
+    //Point every entry at its code first, so that linking queues no stubs for methods of this module
+    std::vector<UALMethod*> methods;
+    module->Methods(methods);
+    for(size_t i = 0;i<methods.size();i++) {
+      if(methods[i]->isManaged) {
+	methods[i]->entry = dlsym(handle,methods[i]->sig->fullSignature.data());
+      }
+    }
+    uint32_t count;
+    reader.Read(count);
+    for(uint32_t i = 0;i<count;i++) {
+      const char* signature = reader.ReadString();
+      uint32_t size;
+      reader.Read(size);
+      UALMethod* method = FindMethod(signature);
+      unsigned char* code = (unsigned char*)dlsym(handle,signature);
+      if(method == 0 || code == 0 || !method->LinkImports(reader,code,size,false)) {
+	printf("Error: Unable to link %s\n",signature);
+	return 0;
+      }
+    }
+    UALMethod::LinkStubs();
+    return module;
+  }
+  void LoadMain(int argc, char** argv) {
+    //Find main
+      UALMethod* mainMethod = FindMain();
+#ifdef PRECOMPILE
+      Compile();
+#endif
+      if(mainMethod == 0) {
 	printf("Error: Unable to find Main.\n");
 	return;
       }
@@ -1924,13 +6032,274 @@ public:
 
 static UALMethod* ResolveMethod(void* assembly, uint32_t handle) {
   UALModule* module = (UALModule*)assembly;
-  std::string signature = module->methodImports[handle];
-  if(methodCache.find(signature) == methodCache.end()) {
+  if(module->indexed) {
+    return module->ResolveImport(handle);
+  }
+  //Only look things up; this runs on several threads while compiling in parallel
+  auto import = module->methodImports.find(handle);
+  if(import == module->methodImports.end()) {
     return 0;
   }
-  return methodCache[signature];
+  return import->second->method;
+}
+//Finds a method of any loaded module by its signature (NULL if there is none)
+static UALMethod* FindMethod(const std::string& signature) {
+  auto sig = signatureTable.find(signature);
+  if(sig != signatureTable.end() && sig->second->method) {
+    return sig->second->method;
+  }
+  for(size_t i = 0;i<loadedModules.size();i++) {
+    if(loadedModules[i]->indexed) {
+      UALMethod* retval = loadedModules[i]->FindIndexed(signature.data());
+      if(retval) {
+	return retval;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * @summary Writes the profile counters of every profiled method (see PROFILE) to a file, hottest first:
+ * calls (on the interpreter, and to native code), and how often each conditional branch was taken, as laid out in native code
+ * */
+static void Profile_Dump(FILE* out) {
+  Console_Sync();
+  std::lock_guard<std::mutex> guard(profileLock);
+  std::vector<UALMethod*> methods = profiledMethods;
+  std::sort(methods.begin(),methods.end(),[](UALMethod* a, UALMethod* b) {
+    return a->profile[0]+a->invocationCount > b->profile[0]+b->invocationCount;
+  });
+  fprintf(out,"%-48s %12s %12s\n","Method","Interpreted","Native");
+  for(size_t i = 0;i<methods.size();i++) {
+    UALMethod* method = methods[i];
+    if(method->isOSR) {
+      fprintf(out,"%-48s %12s %12llu (entered at %u)\n",method->sig->fullSignature.data(),"",(unsigned long long)method->profile[0],(unsigned int)method->osrOffset);
+    }else {
+      fprintf(out,"%-48s %12u %12llu\n",method->sig->fullSignature.data(),(unsigned int)method->invocationCount,(unsigned long long)method->profile[0]);
+    }
+    for(size_t c = 0;c<method->profileBranches.size();c++) {
+      uint64_t executed = method->profile[1+2*c];
+      uint64_t taken = executed-method->profile[2+2*c];
+      fprintf(out,"  branch at %-6u taken %llu of %llu (%.1f%%)\n",(unsigned int)method->profileBranches[c],(unsigned long long)taken,(unsigned long long)executed,executed ? 100.0*taken/executed : 0.0);
+    }
+  }
+  fflush(out);
+}
+//Zeroes the profile counters of every profiled method, to measure from here on
+static void Profile_Reset() {
+  std::lock_guard<std::mutex> guard(profileLock);
+  for(size_t i = 0;i<profiledMethods.size();i++) {
+    memset(profiledMethods[i]->profile,0,(1+2*profiledMethods[i]->profileBranches.size())*sizeof(uint64_t));
+  }
+}
+//Built-ins which let programs profile a part of themselves
+static void ProfileDump() {
+  Profile_Dump(stderr);
+}
+static void ProfileReset() {
+  Profile_Reset();
 }
 
+#ifdef SELFTEST
+//UAL opcodes, for writing test methods
+enum SelfTestOpcode {
+  OpLdArg, OpCall, OpLdStr, OpRet, OpLdInt, OpStLoc, OpBr, OpLdLoc, OpAdd, OpBle, OpNop, OpBeq, OpBne, OpBgt, OpBge,
+  OpSub, OpMul, OpDiv, OpRem, OpShl, OpShr, OpAnd, OpOr, OpXor, OpNot, OpLdDouble, OpLdBuf, OpEnd = 255
+};
+//The bytecode of a test method
+class SelfTestCode {
+public:
+  std::vector<unsigned char> bytes;
+  SelfTestCode& Op(unsigned char opcode) {
+    bytes.push_back(opcode);
+    return *this;
+  }
+  SelfTestCode& Op(unsigned char opcode, uint32_t operand) {
+    bytes.push_back(opcode);
+    Buffer_Append(bytes,operand);
+    return *this;
+  }
+  //The UAL offset of the next instruction
+  uint32_t Here() const {
+    return (uint32_t)bytes.size();
+  }
+  //Points the branch at offset branch to target
+  void Patch(uint32_t branch, uint32_t target) {
+    memcpy(bytes.data()+branch+1,&target,sizeof(target));
+  }
+};
+static size_t selfTestFailures = 0;
+//Internal -- Creates a managed method from bytecode
+static UALMethod* SelfTest_Method(const char* signature, const std::vector<const char*>& locals, const SelfTestCode& code) {
+  std::vector<unsigned char>* definition = new std::vector<unsigned char>(); //Lives as long as the method does
+  bool isManaged = true;
+  Buffer_Append(*definition,isManaged);
+  Buffer_Append(*definition,(uint32_t)locals.size());
+  for(size_t i = 0;i<locals.size();i++) {
+    Buffer_Append(*definition,locals[i],strlen(locals[i])+1);
+  }
+  Buffer_Append(*definition,code.bytes.data(),code.bytes.size());
+  definition->push_back(OpEnd);
+  MethodSignature* sig = InternSignature(signature);
+  sig->method = new UALMethod(BStream(definition->data(),definition->size()),0,sig);
+  return sig->method;
+}
+/**
+ * @summary Runs a test method on the interpreter, then compiles it and runs it again
+ * @param signature The signature of the test method (every test needs a signature of its own)
+ * @param expected What the method has to return both times; System.Int32 results have to be sign-extended, too
+ * */
+static UALMethod* SelfTest_Run(const char* signature, const std::vector<const char*>& locals, const SelfTestCode& code, const std::vector<int32_t>& args, int32_t expected) {
+  UALMethod* method = SelfTest_Method(signature,locals,code);
+  std::vector<uint64_t> values(args.size()+1);
+  for(size_t i = 0;i<args.size();i++) {
+    values[i] = (uint64_t)(int64_t)args[i];
+  }
+  uint64_t interpreted = method->Interpret(values.data());
+  UALMethod::CompileBatch(std::vector<UALMethod*>(1,method));
+  uint64_t compiled = Native_Call(method->nativefunc,values.data(),args.size());
+  if(interpreted != (uint64_t)(int64_t)expected || compiled != (uint64_t)(int64_t)expected) {
+    printf("FAILED %s: expected %i, the interpreter returned %lli and the JIT returned %lli\n",signature,(int)expected,(long long)interpreted,(long long)compiled);
+    selfTestFailures++;
+  }
+  return method;
+}
+/**
+ * @summary Runs a test method which has to abort, on the interpreter and then in JIT code (each in a child process)
+ * */
+static void SelfTest_RunFault(const char* signature, const std::vector<const char*>& locals, const SelfTestCode& code, const std::vector<int32_t>& args) {
+  UALMethod* method = SelfTest_Method(signature,locals,code);
+  std::vector<uint64_t> values(args.size()+1);
+  for(size_t i = 0;i<args.size();i++) {
+    values[i] = (uint64_t)(int64_t)args[i];
+  }
+  for(int compiled = 0;compiled<2;compiled++) {
+    fflush(stdout);
+    pid_t child = fork();
+    if(child == 0) {
+      if(compiled) {
+	UALMethod::CompileBatch(std::vector<UALMethod*>(1,method));
+	Native_Call(method->nativefunc,values.data(),args.size());
+      }else {
+	method->Interpret(values.data());
+      }
+      _exit(0);
+    }
+    int status = 0;
+    if(child < 0 || waitpid(child,&status,0) != child || !WIFSIGNALED(status) || WTERMSIG(status) != SIGABRT) {
+      printf("FAILED %s: %s did not abort\n",signature,compiled ? "the JIT" : "the interpreter");
+      selfTestFailures++;
+    }
+  }
+}
+//Internal -- Builds for(i = 0;i<n;i++) { s+=i; } return s; the way compilers emit it, with the test at the top
+static SelfTestCode SelfTest_ForLoop() {
+  SelfTestCode code;
+  code.Op(OpLdInt,0).Op(OpStLoc,0).Op(OpLdInt,0).Op(OpStLoc,1);
+  uint32_t test = code.Here();
+  code.Op(OpLdLoc,1).Op(OpLdArg,0);
+  uint32_t exit = code.Here();
+  code.Op(OpBge,0);
+  code.Op(OpLdLoc,0).Op(OpLdLoc,1).Op(OpAdd).Op(OpStLoc,0);
+  code.Op(OpLdLoc,1).Op(OpLdInt,1).Op(OpAdd).Op(OpStLoc,1);
+  code.Op(OpBr,test);
+  code.Patch(exit,code.Here());
+  code.Op(OpLdLoc,0).Op(OpRet);
+  return code;
+}
+//Internal -- Builds for(i = 0;i<n;i++) { s+=i*a; u+=i*a; } return s+u; which (with n twice TIER_UP_BACKEDGES) moves to native code halfway, where i*a gets a temporary of its own
+static SelfTestCode SelfTest_OSRLoop() {
+  SelfTestCode code;
+  code.Op(OpLdInt,0).Op(OpStLoc,0).Op(OpLdInt,0).Op(OpStLoc,1).Op(OpLdInt,0).Op(OpStLoc,2);
+  uint32_t test = code.Here();
+  code.Op(OpLdLoc,2).Op(OpLdArg,0);
+  uint32_t exit = code.Here();
+  code.Op(OpBge,0);
+  code.Op(OpLdLoc,0).Op(OpLdLoc,2).Op(OpLdArg,1).Op(OpMul).Op(OpAdd).Op(OpStLoc,0);
+  code.Op(OpLdLoc,1).Op(OpLdLoc,2).Op(OpLdArg,1).Op(OpMul).Op(OpAdd).Op(OpStLoc,1);
+  code.Op(OpLdLoc,2).Op(OpLdInt,1).Op(OpAdd).Op(OpStLoc,2);
+  code.Op(OpBr,test);
+  code.Patch(exit,code.Here());
+  code.Op(OpLdLoc,0).Op(OpLdLoc,1).Op(OpAdd).Op(OpRet);
+  return code;
+}
+/**
+ * @summary Checks that the interpreter and the JIT give UAL the same semantics
+ * @returns The exit code of UALRunner --selftest
+ * */
+static int SelfTest() {
+  //System.Int32 arithmetic wraps around at 32 bits, even when the result is only an intermediate of a division
+  SelfTest_Run("System.Int32 SelfTest::MulDivConstant(System.Int32,System.Int32)",{},
+	       SelfTestCode().Op(OpLdArg,0).Op(OpLdArg,1).Op(OpMul).Op(OpLdInt,3).Op(OpDiv).Op(OpRet),{46341,46341},-715826338);
+  SelfTest_Run("System.Int32 SelfTest::MulDivNegative(System.Int32,System.Int32)",{},
+	       SelfTestCode().Op(OpLdArg,0).Op(OpLdArg,1).Op(OpMul).Op(OpLdInt,(uint32_t)-7).Op(OpDiv).Op(OpRet),{-100000,100000},201437915);
+  SelfTest_Run("System.Int32 SelfTest::AddDiv(System.Int32,System.Int32,System.Int32)",{},
+	       SelfTestCode().Op(OpLdArg,0).Op(OpLdArg,1).Op(OpAdd).Op(OpLdArg,2).Op(OpDiv).Op(OpRet),{INT32_MAX,1,7},-306783378);
+  SelfTest_Run("System.Int32 SelfTest::SubRem(System.Int32,System.Int32,System.Int32)",{},
+	       SelfTestCode().Op(OpLdArg,0).Op(OpLdArg,1).Op(OpSub).Op(OpLdArg,2).Op(OpRem).Op(OpRet),{INT32_MIN,1,10},7);
+  SelfTest_Run("System.Int32 SelfTest::MulConstant(System.Int32)",{},
+	       SelfTestCode().Op(OpLdArg,0).Op(OpLdInt,6).Op(OpMul).Op(OpRet),{0x20000000},-1073741824);
+  //Folded constants wrap around exactly like computed values do
+  SelfTest_Run("System.Int32 SelfTest::FoldedShiftAdd()",{},
+	       SelfTestCode().Op(OpLdInt,1).Op(OpLdInt,30).Op(OpShl).Op(OpLdInt,1).Op(OpLdInt,30).Op(OpShl).Op(OpAdd).Op(OpRet),{},INT32_MIN);
+  SelfTest_Run("System.Int32 SelfTest::ShiftAdd(System.Int32,System.Int32)",{},
+	       SelfTestCode().Op(OpLdArg,0).Op(OpLdArg,1).Op(OpShl).Op(OpLdArg,0).Op(OpLdArg,1).Op(OpShl).Op(OpAdd).Op(OpRet),{1,30},INT32_MIN);
+  SelfTest_Run("System.Int32 SelfTest::FoldedMulDiv()",{},
+	       SelfTestCode().Op(OpLdInt,46341).Op(OpLdInt,46341).Op(OpMul).Op(OpLdInt,3).Op(OpDiv).Op(OpRet),{},-715826338);
+  SelfTest_Run("System.Int32 SelfTest::FoldedShiftCount()",{},
+	       SelfTestCode().Op(OpLdInt,1).Op(OpLdInt,33).Op(OpShl).Op(OpRet),{},2);
+  SelfTest_Run("System.Int32 SelfTest::ShiftCount(System.Int32,System.Int32)",{},
+	       SelfTestCode().Op(OpLdArg,0).Op(OpLdArg,1).Op(OpShl).Op(OpRet),{1,33},2);
+  //A loop tested at the top gets a copy of its test at the bottom, instead of jumping back to the top (see UALMethod::LayoutBranches)
+  {
+    UALMethod* method = SelfTest_Method("System.Int32 SelfTest::ForLoopLayout(System.Int32)",{"System.Int32","System.Int32"},SelfTest_ForLoop());
+    method->Prepare();
+    bool loops = false;
+    for(Node* inst = method->instructions;inst != 0;inst = inst->next) {
+      Branch* b = (Branch*)inst;
+      if(inst->type != NBranch || b->offset > b->ualip) {
+	continue;
+      }
+      if(b->condition == UnconditionalSurrender) {
+	printf("FAILED SelfTest::ForLoopLayout: the loop still takes a jump back to its test\n");
+	selfTestFailures++;
+      }
+      loops = true;
+    }
+    if(!loops) {
+      printf("FAILED SelfTest::ForLoopLayout: the loop has no backward branch\n");
+      selfTestFailures++;
+    }
+  }
+  SelfTest_Run("System.Int32 SelfTest::ForLoop(System.Int32)",{"System.Int32","System.Int32"},SelfTest_ForLoop(),{10},45);
+  SelfTest_Run("System.Int32 SelfTest::ForLoopNone(System.Int32)",{"System.Int32","System.Int32"},SelfTest_ForLoop(),{0},0);
+  //An interpreted activation which moves to native code takes over the declared locals only, not the temporaries the optimizer adds (see UALMethod::OSREntry)
+  {
+    UALMethod* method = SelfTest_Run("System.Int32 SelfTest::OSRLoop(System.Int32,System.Int32)",{"System.Int32","System.Int32","System.Int32"},SelfTest_OSRLoop(),{20000,3},1199940000);
+    if(method->localVarCount == method->declaredLocalCount) {
+      printf("FAILED SelfTest::OSRLoop: the optimizer added no temporaries, so this tests nothing\n");
+      selfTestFailures++;
+    }
+  }
+  //Division by zero, and the one division which overflows, abort on both
+  SelfTest_RunFault("System.Int32 SelfTest::DivZero(System.Int32,System.Int32)",{},
+		    SelfTestCode().Op(OpLdArg,0).Op(OpLdArg,1).Op(OpDiv).Op(OpRet),{1,0});
+  SelfTest_RunFault("System.Int32 SelfTest::RemOverflow(System.Int32,System.Int32)",{},
+		    SelfTestCode().Op(OpLdArg,0).Op(OpLdArg,1).Op(OpRem).Op(OpRet),{INT32_MIN,-1});
+  SelfTest_RunFault("System.Int32 SelfTest::DivMinusOne(System.Int32)",{},
+		    SelfTestCode().Op(OpLdArg,0).Op(OpLdInt,(uint32_t)-1).Op(OpDiv).Op(OpRet),{INT32_MIN});
+  //A division which may trap is not dead code, even if nothing reads its result
+  SelfTest_RunFault("System.Int32 SelfTest::DeadDivZero(System.Int32,System.Int32)",{"System.Int32"},
+		    SelfTestCode().Op(OpLdArg,0).Op(OpLdArg,1).Op(OpDiv).Op(OpStLoc,0).Op(OpLdInt,0).Op(OpRet),{1,0});
+  if(selfTestFailures) {
+    printf("%i self tests failed\n",(int)selfTestFailures);
+    return -1;
+  }
+  printf("All self tests passed\n");
+  return 0;
+}
+#endif
 
 int main(int argc, char** argv) {
   //JIT test
@@ -1953,9 +6322,9 @@ int main(int argc, char** argv) {
   printf("%i\n",ret);
   return 0;
   */
+  std::set_terminate(Runtime_Terminate);
   JITruntime = new asmjit::JitRuntime();
-  JITAssembler = new asmjit::X86Assembler(JITruntime);
-  JITCompiler = new asmjit::X86Compiler(JITAssembler);
+  JIT_EnsureContext();
   
   
   
@@ -1994,27 +6363,56 @@ int main(int argc, char** argv) {
   
   return 0;*/
   //Register built-ins
-  abi_ext["ConsoleOut"] = (void*)ConsoleOut;
-  abi_ext["PrintInt"] = (void*)PrintInt;
-  abi_ext["PrintDouble"] = (void*)PrintDouble;
+  Native_Register("ConsoleOut",ConsoleOut);
+  Native_Register("PrintInt",PrintInt);
+  Native_Register("PrintDouble",PrintDouble);
+  Native_Register("ConsoleFlush",ConsoleFlush);
+  Native_Register("ConsoleSetBuffering",ConsoleSetBuffering);
+  Native_Register("ProfileDump",ProfileDump);
+  Native_Register("ProfileReset",ProfileReset);
+#ifdef PROFILE
+  atexit(ProfileDump);
+#endif
   
   UALType* btype = new UALType();
   btype->isStruct = true;
   btype->size = 4; //32-bit integer.
   btype->name = "System.Int32";
-  typeCache["System.Int32"] = btype;
+  RegisterType(btype);
   btype = new UALType();
   btype->isStruct = false;
   btype->size = sizeof(size_t); //A String just has a single pointer.
   btype->name = "System.String";
-  typeCache["System.String"] = btype;
+  RegisterType(btype);
   btype = new UALType();
   btype->isStruct = true;
   btype->size = 8;
   btype->name = "System.Double";
-  typeCache["System.Double"] = btype;
+  RegisterType(btype);
   
   
+  //UALRunner --ext <library> ... loads native extensions first
+  while(argc>2 && strcmp(argv[1],"--ext") == 0) {
+    if(!Extension_Load(argv[2])) {
+      return -1;
+    }
+    argv+=2;
+    argc-=2;
+  }
+#ifdef SELFTEST
+  if(argc>1 && strcmp(argv[1],"--selftest") == 0) {
+    gc = GC_Init(3);
+    return SelfTest();
+  }
+#endif
+  //UALRunner --aot <program> <output> compiles the program to a shared object, which UALRunner runs like the program itself
+  bool aot = argc>3 && strcmp(argv[1],"--aot") == 0;
+  //UALRunner --index <program> <output> rewrites the program in the indexed format, which loads on demand
+  bool index = argc>3 && strcmp(argv[1],"--index") == 0;
+  if(aot || index) {
+    argv++;
+    argc--;
+  }
   int fd = 0;
   if(argc>1) {
   fd = open(argv[1],O_RDONLY);
@@ -2027,7 +6425,41 @@ int main(int argc, char** argv) {
   size_t len = us.st_size;
   void* ptr = mmap(0,len,PROT_READ,MAP_SHARED,fd,0);
   gc = GC_Init(3);
-  UALModule* module = new UALModule(ptr,len);
+#ifdef CODE_CACHE_DIR
+  Cache_Directory();
+#endif
+  UALModule* module;
+  if(len >= SELFMAG && memcmp(ptr,ELFMAG,SELFMAG) == 0) {
+    munmap(ptr,len);
+    if(aot || index) {
+      printf("Error: %s has been compiled already.\n",argv[1]);
+      return -1;
+    }
+    module = UALModule::LoadNative(argv[1]);
+    if(module == 0) {
+      return -1;
+    }
+  }else {
+    module = new UALModule(ptr,len);
+  }
+  if(aot) {
+    if(!module->SaveNative(argv[2])) {
+      printf("Error: Unable to write %s\n",argv[2]);
+      return -1;
+    }
+    return 0;
+  }
+  if(index) {
+    if(module->indexed) {
+      printf("Error: %s is indexed already.\n",argv[1]);
+      return -1;
+    }
+    if(!module->SaveIndexed(argv[2])) {
+      printf("Error: Unable to write %s\n",argv[2]);
+      return -1;
+    }
+    return 0;
+  }
   module->LoadMain(argc-2,argv+2);
   return 0;
 }